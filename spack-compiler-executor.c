@@ -0,0 +1,174 @@
+// Local stand-in for a remote compile executor: accepts compile requests from
+// spack-compiler-wrapper.so on a Unix socket (SPACK_REMOTE_EXECUTOR=<socket>),
+// compiles the preprocessed unit and sends back the object file.
+//
+// Usage: spack-compiler-executor <socket>
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "spack-executor-protocol.h"
+
+static char *read_file(const char *path, uint64_t *n) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL &&
+        spack_read_all(fd, buf, st.st_size) != 0) {
+        free(buf);
+        buf = NULL;
+    }
+    close(fd);
+    if (buf != NULL)
+        *n = st.st_size;
+    return buf;
+}
+
+static int write_file(const char *path, char const *buf, uint64_t n) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+    int err = spack_write_all(fd, buf, n);
+    return close(fd) != 0 ? -1 : err;
+}
+
+static int handle(int fd) {
+    char magic[4];
+    uint32_t version, argc;
+    if (spack_read_all(fd, magic, 4) != 0 ||
+        memcmp(magic, SPACK_EXECUTOR_MAGIC, 4) != 0 ||
+        spack_recv_u32(fd, &version) != 0 || version != SPACK_EXECUTOR_VERSION ||
+        spack_recv_u32(fd, &argc) != 0 || argc == 0 || argc > 1 << 20)
+        return -1;
+
+    // argv, then -o <obj> <unit>
+    char **argv = calloc(argc + 4, sizeof(char *));
+    if (argv == NULL)
+        return -1;
+    uint64_t n;
+    for (uint32_t j = 0; j < argc; ++j)
+        if ((argv[j] = spack_recv_bytes(fd, &n)) == NULL)
+            return -1;
+    char *cwd, *suffix, *unit;
+    uint64_t unit_len;
+    if ((cwd = spack_recv_bytes(fd, &n)) == NULL ||
+        (suffix = spack_recv_bytes(fd, &n)) == NULL || strchr(suffix, '/') != NULL ||
+        (unit = spack_recv_bytes(fd, &unit_len)) == NULL)
+        return -1;
+
+    char const *tmpdir = getenv("TMPDIR");
+    char dir[1024], obj[1100], src[1100], out[1100], err[1100];
+    snprintf(dir, sizeof(dir), "%s/spack-executor-XXXXXX", tmpdir ? tmpdir : "/tmp");
+    if (mkdtemp(dir) == NULL)
+        return -1;
+    snprintf(obj, sizeof(obj), "%s/unit.o", dir);
+    snprintf(src, sizeof(src), "%s/unit%s", dir, suffix);
+    snprintf(out, sizeof(out), "%s/stdout", dir);
+    snprintf(err, sizeof(err), "%s/stderr", dir);
+    argv[argc] = "-o";
+    argv[argc + 1] = obj;
+    argv[argc + 2] = src;
+    argv[argc + 3] = NULL;
+
+    // The child reports a failure to set up or exec over a close-on-exec pipe.
+    uint32_t status = SPACK_EXECUTOR_ERROR;
+    int setup[2];
+    if (write_file(src, unit, unit_len) == 0 && pipe2(setup, O_CLOEXEC) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Compile in the client's working directory when it's shared, so
+            // that debug info is the same as for a local compile.
+            close(setup[0]);
+            int o = -1, e = -1;
+            if ((chdir(cwd) == 0 || chdir(dir) == 0) &&
+                (o = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0 &&
+                (e = open(err, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0 &&
+                dup2(o, 1) >= 0 && dup2(e, 2) >= 0)
+                execv(argv[0], argv);
+            spack_write_all(setup[1], "x", 1);
+            _exit(127);
+        }
+        close(setup[1]);
+        char c;
+        int wstatus;
+        if (pid > 0 && read(setup[0], &c, 1) == 0 && waitpid(pid, &wstatus, 0) == pid &&
+            WIFEXITED(wstatus))
+            status = WEXITSTATUS(wstatus);
+        close(setup[0]);
+    }
+
+    uint64_t out_len = 0, err_len = 0, obj_len = 0;
+    char *out_buf = read_file(out, &out_len);
+    char *err_buf = read_file(err, &err_len);
+    char *obj_buf = status == 0 ? read_file(obj, &obj_len) : NULL;
+    if (status == 0 && obj_buf == NULL)
+        status = SPACK_EXECUTOR_ERROR;
+
+    int res = spack_send_all(fd, SPACK_EXECUTOR_MAGIC, 4) != 0 ||
+                      spack_send_u32(fd, status) != 0 ||
+                      spack_send_bytes(fd, out_buf, out_buf ? out_len : 0) != 0 ||
+                      spack_send_bytes(fd, err_buf, err_buf ? err_len : 0) != 0 ||
+                      spack_send_bytes(fd, obj_buf, obj_buf ? obj_len : 0) != 0
+                  ? -1
+                  : 0;
+
+    unlink(src);
+    unlink(obj);
+    unlink(out);
+    unlink(err);
+    rmdir(dir);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <socket>\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", argv[1]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    // The socket runs arbitrary commands, so keep it private to the user.
+    umask(077);
+    unlink(argv[1]);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(sock, 128) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // Reap children automatically.
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            signal(SIGCHLD, SIG_DFL);
+            _exit(handle(fd) == 0 ? 0 : 1);
+        }
+        close(fd);
+    }
+}
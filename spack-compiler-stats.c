@@ -0,0 +1,89 @@
+// Print a summary of the SPACK_METRICS_FILE written by spack-compiler-wrapper.so.
+//
+// Usage: spack-compiler-stats <file>
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spack-metrics.h"
+
+static const char *executables[SPACK_METRICS_EXECUTABLES] = {
+    "cc", "c++", "fc", "f77", "ld", "ar", "ranlib", "nm", "other"};
+
+static const char *modes[SPACK_METRICS_MODES] = {"ccld",    "cc",      "as",
+                                                 "cpp",     "version", "internal"};
+
+static uint64_t load(uint64_t const *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Upper bound of the bucket containing the given quantile.
+static uint64_t quantile_ns(struct spack_metrics_t const *m, uint64_t total,
+                            double q) {
+    uint64_t seen = 0;
+    for (size_t j = 0; j < SPACK_METRICS_BUCKETS; ++j) {
+        seen += load(&m->latency[j]);
+        if (seen > 0 && seen >= q * total)
+            return (uint64_t)2 << j;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct spack_metrics_t const *m;
+    if (st.st_size < (off_t)sizeof(*m) ||
+        (m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        m->magic != SPACK_METRICS_MAGIC) {
+        fprintf(stderr, "%s: not a spack-compiler-wrapper metrics file\n", argv[1]);
+        return 1;
+    }
+    close(fd);
+
+    uint64_t execs = load(&m->execs);
+    uint64_t total_ns = load(&m->total_ns);
+    printf("execs:        %" PRIu64 "\n", execs);
+    printf("rewritten:    %" PRIu64 "\n", load(&m->rewritten));
+    printf("passthrough:  %" PRIu64 "\n", load(&m->passthrough));
+    printf("bytes copied: %" PRIu64 "\n", load(&m->bytes_copied));
+    printf("wrapper time: %.3f s (mean %.1f us)\n", total_ns / 1e9,
+           execs ? total_ns / 1e3 / execs : 0.0);
+    if (execs > 0)
+        printf("latency:      p50 < %.3f us, p90 < %.3f us, p99 < %.3f us\n",
+               quantile_ns(m, execs, 0.5) / 1e3, quantile_ns(m, execs, 0.9) / 1e3,
+               quantile_ns(m, execs, 0.99) / 1e3);
+
+    printf("\nper executable:\n");
+    for (size_t j = 0; j < SPACK_METRICS_EXECUTABLES; ++j)
+        if (load(&m->executable[j]) != 0)
+            printf("  %-10s %" PRIu64 "\n", executables[j], load(&m->executable[j]));
+
+    printf("\nper mode (rewritten):\n");
+    for (size_t j = 0; j < SPACK_METRICS_MODES; ++j)
+        if (load(&m->mode[j]) != 0)
+            printf("  %-10s %" PRIu64 "\n", modes[j], load(&m->mode[j]));
+
+    printf("\nlatency histogram:\n");
+    for (size_t j = 0; j < SPACK_METRICS_BUCKETS; ++j)
+        if (load(&m->latency[j]) != 0)
+            printf("  < %12" PRIu64 " ns %" PRIu64 "\n", (uint64_t)2 << j,
+                   load(&m->latency[j]));
+
+    return 0;
+}
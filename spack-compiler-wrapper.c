@@ -2,14 +2,42 @@
 #define SPACK_PATH_MAX 1024
 
 #include <alloca.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
 #include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-enum executable_t { SPACK_CC, SPACK_CXX, SPACK_FC, SPACK_F77, SPACK_LD, SPACK_NONE };
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spack-compiler-wrapper.h"
+#include "spack-executor-protocol.h"
+#include "spack-metrics.h"
+
+enum executable_t {
+    SPACK_CC,
+    SPACK_CXX,
+    SPACK_FC,
+    SPACK_F77,
+    SPACK_LD,
+    SPACK_AR,
+    SPACK_RANLIB,
+    SPACK_NM,
+    SPACK_NONE
+};
 
 enum mode_t {
     SPACK_MODE_CCLD,     // preprocess, compile, assemble, link
@@ -20,6 +48,33 @@ enum mode_t {
     SPACK_MODE_INTERNAL, // e.g. clang -cc1
 };
 
+enum family_t { SPACK_FAMILY_GCC, SPACK_FAMILY_CLANG, SPACK_FAMILY_UNKNOWN };
+
+enum lto_t {
+    SPACK_LTO_NONE,
+    SPACK_LTO_FULL, // SPACK_LTO=full: monolithic LTO
+    SPACK_LTO_THIN, // SPACK_LTO=thin: ThinLTO, or GCC's partitioned LTO
+    SPACK_LTO_AUTO, // SPACK_LTO=auto: the parallel flavor of the compiler
+};
+
+enum pgo_t {
+    SPACK_PGO_NONE,
+    SPACK_PGO_GENERATE, // SPACK_PGO=generate: instrumented build
+    SPACK_PGO_USE,      // SPACK_PGO=use: optimize with the collected profiles
+};
+
+// Where the rewrite happens; work on the side, like merging profiles, is only
+// done when the command is run.
+enum context_t {
+    SPACK_CONTEXT_EXEC,  // exec*: in the process that is replaced by the command
+    SPACK_CONTEXT_SPAWN, // posix_spawn: in the parent, e.g. make 4.3+
+    SPACK_CONTEXT_API,   // spack_rewrite_args: the command is not run
+};
+
+_Static_assert(SPACK_NONE + 1 == SPACK_METRICS_EXECUTABLES, "update spack-metrics.h");
+_Static_assert(SPACK_MODE_INTERNAL + 1 == SPACK_METRICS_MODES,
+               "update spack-metrics.h");
+
 struct string_table_t {
     char *arr;
     size_t n;
@@ -35,6 +90,7 @@ struct offset_list_t {
 struct state_t {
     enum executable_t type;
     enum mode_t mode;
+    enum context_t context;
     struct string_table_t strings;
 
     // -march etc
@@ -64,6 +120,9 @@ struct state_t {
     int has_ccache;
     size_t offset_ccache;
     size_t offset_compiler_or_linker;
+
+    // SPACK_SYSTEM_DIRS
+    char const *system_dirs;
 };
 
 struct new_args {
@@ -95,6 +154,15 @@ static const char *spack_f77[] = {"f77", "xlf", "xlf_r", "pgf77", "amdflang"};
 // SPACK_LD
 static const char *spack_ld[] = {"ld", "ld.gold", "ld.lld", "ld.bfd", "ld.mold"};
 
+// SPACK_AR, only with SPACK_LTO
+static const char *spack_ar[] = {"ar"};
+
+// SPACK_RANLIB, only with SPACK_LTO
+static const char *spack_ranlib[] = {"ranlib"};
+
+// SPACK_NM, only with SPACK_LTO; libtool reads the symbols of LTO objects with it
+static const char *spack_nm[] = {"nm"};
+
 static void string_table_init(struct string_table_t *t) {
     t->arr = NULL;
     t->n = 0;
@@ -187,6 +255,12 @@ static const char *get_spack_variable(enum executable_t type) {
         return "SPACK_F77";
     case SPACK_LD:
         return "SPACK_LD";
+    case SPACK_AR:
+        return "SPACK_AR";
+    case SPACK_RANLIB:
+        return "SPACK_RANLIB";
+    case SPACK_NM:
+        return "SPACK_NM";
     default:
         return NULL;
     }
@@ -224,10 +298,11 @@ static void arg_parse_init(struct state_t *s) {
 
     offset_list_init(&s->env);
     s->has_ccache = 0;
+    s->system_dirs = getenv("SPACK_SYSTEM_DIRS");
 }
 
-// re-assemble the command line arguments
-static char *const *arg_parse_finish(struct state_t const *s) {
+// number of command line arguments, including the terminating NULL
+static size_t arg_parse_count(struct state_t const *s) {
     size_t n = s->spack_compiler_flags.n + s->isystem_include_flags.n +
                s->include_flags.n + s->spack_include_flags.n +
                s->isystem_system_include_flags.n + s->system_include_flags.n +
@@ -236,8 +311,11 @@ static char *const *arg_parse_finish(struct state_t const *s) {
                s->other_flags.n;
     if (s->has_ccache)
         ++n;
-    char **argv = malloc((n + 2) * sizeof(char *));
+    return n + 2;
+}
 
+// re-assemble the command line arguments
+static void arg_parse_fill(struct state_t const *s, char **argv) {
     size_t i = 0;
 
     if (s->has_ccache)
@@ -282,37 +360,6 @@ static char *const *arg_parse_finish(struct state_t const *s) {
         argv[i++] = s->strings.arr + s->other_flags.offsets[j];
 
     argv[i] = NULL;
-    return argv;
-}
-
-// create env
-static char *const *env_finish(struct state_t const *s) {
-    char **env = malloc((s->env.n + 1) * sizeof(char *));
-    for (size_t j = 0; j < s->env.n; ++j)
-        env[j] = s->strings.arr + s->env.offsets[j];
-    env[s->env.n] = NULL;
-    return env;
-}
-
-static int count_args(va_list *ap) {
-    va_list aq;
-    va_copy(aq, *ap);
-
-    int i = 0;
-    while (va_arg(aq, char *))
-        i++;
-    va_end(aq);
-    return i;
-}
-
-static void copy_args(char **argv, const char *arg0, va_list *ap) {
-    int i = 1;
-    char *arg;
-    while ((arg = va_arg(*ap, char *)))
-        argv[i++] = arg;
-
-    ((const char **)argv)[0] = arg0;
-    ((const char **)argv)[i] = NULL;
 }
 
 static const char *get_filename(const char *p) {
@@ -338,16 +385,83 @@ static enum executable_t compiler_type(const char *filename) {
     for (size_t j = 0; j < sizeof(spack_ld) / sizeof(char *); ++j)
         if (strcmp(filename, spack_ld[j]) == 0)
             return SPACK_LD;
+    for (size_t j = 0; j < sizeof(spack_ar) / sizeof(char *); ++j)
+        if (strcmp(filename, spack_ar[j]) == 0)
+            return SPACK_AR;
+    for (size_t j = 0; j < sizeof(spack_ranlib) / sizeof(char *); ++j)
+        if (strcmp(filename, spack_ranlib[j]) == 0)
+            return SPACK_RANLIB;
+    for (size_t j = 0; j < sizeof(spack_nm) / sizeof(char *); ++j)
+        if (strcmp(filename, spack_nm[j]) == 0)
+            return SPACK_NM;
     return SPACK_NONE;
 }
 
+// Guess the compiler family from the name of the compiler or linker.
+static enum family_t compiler_family(const char *path) {
+    const char *filename = get_filename(path);
+    if (strstr(filename, "clang") != NULL || strstr(filename, "flang") != NULL ||
+        strcmp(filename, "ld.lld") == 0 || strcmp(filename, "icx") == 0 ||
+        strcmp(filename, "icpx") == 0 || strcmp(filename, "ifx") == 0)
+        return SPACK_FAMILY_CLANG;
+    if (strstr(filename, "gcc") != NULL || strstr(filename, "g++") != NULL ||
+        strstr(filename, "gfortran") != NULL)
+        return SPACK_FAMILY_GCC;
+    return SPACK_FAMILY_UNKNOWN;
+}
+
+static enum lto_t lto_mode(void) {
+    char const *lto = getenv("SPACK_LTO");
+    if (lto == NULL)
+        return SPACK_LTO_NONE;
+    if (strcmp(lto, "full") == 0)
+        return SPACK_LTO_FULL;
+    if (strcmp(lto, "thin") == 0)
+        return SPACK_LTO_THIN;
+    if (strcmp(lto, "auto") == 0)
+        return SPACK_LTO_AUTO;
+    return SPACK_LTO_NONE;
+}
+
+// ar, ranlib and nm, which need the LTO plugin to read LTO objects.
+static int archiver_type(enum executable_t type) {
+    return type == SPACK_AR || type == SPACK_RANLIB || type == SPACK_NM;
+}
+
+// The LTO-aware archiver next to SPACK_CC, e.g. gcc-ar or llvm-ar. Returns
+// whether it exists.
+static int archiver_path(enum executable_t type, char *path) {
+    static const char *gcc[] = {"gcc-ar", "gcc-ranlib", "gcc-nm"};
+    static const char *llvm[] = {"llvm-ar", "llvm-ranlib", "llvm-nm"};
+    char const *cc = getenv("SPACK_CC");
+    if (cc == NULL || !archiver_type(type))
+        return 0;
+    char const *tool;
+    switch (compiler_family(cc)) {
+    case SPACK_FAMILY_GCC:
+        tool = gcc[type - SPACK_AR];
+        break;
+    case SPACK_FAMILY_CLANG:
+        tool = llvm[type - SPACK_AR];
+        break;
+    default:
+        return 0;
+    }
+    size_t dir_len = get_filename(cc) - cc;
+    if (dir_len + strlen(tool) >= SPACK_PATH_MAX)
+        return 0;
+    memcpy(path, cc, dir_len);
+    strcpy(path + dir_len, tool);
+    return access(path, X_OK) == 0;
+}
+
 // Compiler wrapper stuff
 
-static int system_path(const char *p) {
-    char *sysdir = getenv("SPACK_SYSTEM_DIRS");
+static int system_path(struct state_t const *s, const char *p) {
+    char const *sysdir = s->system_dirs;
     if (sysdir == NULL)
         return 0;
-    char *end;
+    char const *end;
     while (1) {
         end = strchr(sysdir, ':');
         size_t len = end == NULL ? strlen(sysdir) : end - sysdir;
@@ -425,7 +539,8 @@ static void parse_ld(char *const *argv, struct state_t *s) {
                 offset_list_push(&s->other_flags, string_table_store(&s->strings, arg));
                 break;
             }
-            offset_list_push(system_path(c) ? &s->system_lib_flags : &s->lib_flags,
+            offset_list_push(system_path(s, c) ? &s->system_lib_flags
+                                               : &s->lib_flags,
                              string_table_store_flag(&s->strings, "-L", c));
             continue;
         } else if (strcmp(c, "-enable-new-dtags") == 0 ||
@@ -451,7 +566,8 @@ static void parse_ld(char *const *argv, struct state_t *s) {
                 offset_list_push(&s->other_flags, string_table_store(&s->strings, arg));
                 break;
             }
-            offset_list_push(system_path(c) ? &s->system_rpath_flags : &s->rpath_flags,
+            offset_list_push(system_path(s, c) ? &s->system_rpath_flags
+                                               : &s->rpath_flags,
                              string_table_store_flag(&s->strings, "--rpath=", c));
         }
     }
@@ -477,8 +593,8 @@ static void parse_cc(char *const *argv, struct state_t *s) {
                 offset_list_push(&s->other_flags, string_table_store(&s->strings, arg));
                 break;
             }
-            offset_list_push(system_path(c) ? &s->system_include_flags
-                                            : &s->include_flags,
+            offset_list_push(system_path(s, c) ? &s->system_include_flags
+                                               : &s->include_flags,
                              string_table_store_flag(&s->strings, "-I", c));
         } else if (strncmp(c, "isystem", 7) == 0) {
             if (*(c += 7) == '\0' && (c = argv[++j]) == NULL) {
@@ -488,7 +604,7 @@ static void parse_cc(char *const *argv, struct state_t *s) {
 
             // Just split -system xxx for readability, even though
             // -isystem/path is allowed, apparently...
-            if (system_path(c)) {
+            if (system_path(s, c)) {
                 offset_list_push(&s->isystem_system_include_flags,
                                  string_table_store(&s->strings, "-isystem"));
                 offset_list_push(&s->isystem_system_include_flags,
@@ -516,6 +632,14 @@ static void parse_argv(char *const *argv, struct state_t *s) {
     case SPACK_F77:
         parse_cc(argv, s);
         break;
+    case SPACK_AR:
+    case SPACK_RANLIB:
+    case SPACK_NM:
+        if (argv[0] == NULL)
+            break;
+        for (size_t j = 1; argv[j] != NULL; ++j)
+            offset_list_push(&s->other_flags, string_table_store(&s->strings, argv[j]));
+        break;
     default:
         break;
     }
@@ -560,6 +684,301 @@ static void store_delimited(char const *str, char delim, struct string_table_t *
     }
 }
 
+// Create a cache directory; the in-process API has no side effects.
+static void cache_mkdir(struct state_t const *s, char const *dir) {
+    if (s->context != SPACK_CONTEXT_API)
+        mkdir(dir, 0777);
+}
+
+// -flto for SPACK_LTO, and at link time a size-bounded ThinLTO cache in
+// SPACK_LTO_CACHE_DIR; for GCC (15+) an incremental LTO cache with
+// SPACK_LTO_INCREMENTAL. Clang links get the cache in parse_lto_link.
+static void parse_lto(struct state_t *s) {
+    enum lto_t lto = lto_mode();
+    if (lto == SPACK_LTO_NONE)
+        return;
+
+    enum family_t family = compiler_family(override_path(s->type));
+    char const *cache = getenv("SPACK_LTO_CACHE_DIR");
+    char const *cache_size = getenv("SPACK_LTO_CACHE_SIZE");
+    if (cache_size == NULL)
+        cache_size = "1g";
+
+    // Only lld takes the cache flags when invoked directly.
+    if (s->type == SPACK_LD) {
+        if (family != SPACK_FAMILY_CLANG || lto == SPACK_LTO_FULL || cache == NULL)
+            return;
+        cache_mkdir(s, cache);
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store_flag(&s->strings, "--thinlto-cache-dir=",
+                                                 cache));
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store_flag(
+                             &s->strings,
+                             "--thinlto-cache-policy=cache_size_bytes=", cache_size));
+        return;
+    }
+
+    // Don't emit IR for -E and -S, configure scripts inspect their output.
+    if (s->mode != SPACK_MODE_CC && s->mode != SPACK_MODE_CCLD)
+        return;
+
+    char const *flag;
+    switch (family) {
+    case SPACK_FAMILY_GCC:
+        flag = lto == SPACK_LTO_FULL ? "-flto" : "-flto=auto";
+        break;
+    case SPACK_FAMILY_CLANG:
+        flag = lto == SPACK_LTO_FULL ? "-flto=full" : "-flto=thin";
+        break;
+    default:
+        // Other compilers spell it differently, if they have it at all.
+        return;
+    }
+    offset_list_push(&s->spack_compiler_flags, string_table_store(&s->strings, flag));
+
+    if (s->mode != SPACK_MODE_CCLD || lto == SPACK_LTO_FULL || cache == NULL)
+        return;
+
+    // Older GCCs reject -flto-incremental=; it bounds the cache by number of
+    // entries itself.
+    if (family == SPACK_FAMILY_GCC && getenv("SPACK_LTO_INCREMENTAL") != NULL) {
+        cache_mkdir(s, cache);
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store_flag(&s->strings, "-flto-incremental=",
+                                                 cache));
+    }
+}
+
+// Whether arg selects lld as the linker; the last -fuse-ld= or --ld-path= wins.
+static int lld_flag(const char *arg, int uses_lld) {
+    if (strncmp(arg, "-fuse-ld=", 9) == 0)
+        return strcmp(arg + 9, "lld") == 0;
+    if (strncmp(arg, "--ld-path=", 10) == 0)
+        return strcmp(get_filename(arg + 10), "ld.lld") == 0;
+    return uses_lld;
+}
+
+// The ThinLTO cache of a Clang link. Only lld takes the cache flags, and GNU ld
+// or gold is the default, so check for -fuse-ld=lld in SPACK_LDFLAGS and argv.
+static void parse_lto_link(struct state_t *s, char *const *argv) {
+    enum lto_t lto = lto_mode();
+    char const *cache = getenv("SPACK_LTO_CACHE_DIR");
+    char const *cache_size = getenv("SPACK_LTO_CACHE_SIZE");
+    if (lto == SPACK_LTO_NONE || lto == SPACK_LTO_FULL || cache == NULL ||
+        s->mode != SPACK_MODE_CCLD ||
+        (s->type != SPACK_CC && s->type != SPACK_CXX && s->type != SPACK_FC &&
+         s->type != SPACK_F77) ||
+        compiler_family(override_path(s->type)) != SPACK_FAMILY_CLANG)
+        return;
+
+    int uses_lld = 0;
+    for (size_t j = 0; j < s->spack_compiler_flags.n; ++j)
+        uses_lld = lld_flag(s->strings.arr + s->spack_compiler_flags.offsets[j],
+                            uses_lld);
+    for (size_t j = 1; argv[j] != NULL; ++j)
+        uses_lld = lld_flag(argv[j], uses_lld);
+    if (!uses_lld)
+        return;
+
+    cache_mkdir(s, cache);
+    offset_list_push(&s->spack_compiler_flags,
+                     string_table_store_flag(&s->strings, "-Wl,--thinlto-cache-dir=",
+                                             cache));
+    offset_list_push(&s->spack_compiler_flags,
+                     string_table_store_flag(
+                         &s->strings, "-Wl,--thinlto-cache-policy=cache_size_bytes=",
+                         cache_size == NULL ? "1g" : cache_size));
+}
+
+static enum pgo_t pgo_mode(void) {
+    char const *pgo = getenv("SPACK_PGO");
+    if (pgo == NULL)
+        return SPACK_PGO_NONE;
+    if (strcmp(pgo, "generate") == 0)
+        return SPACK_PGO_GENERATE;
+    if (strcmp(pgo, "use") == 0)
+        return SPACK_PGO_USE;
+    return SPACK_PGO_NONE;
+}
+
+// SPACK_PGO_DIR/<package>, where the package name is SPACK_PGO_PACKAGE or the
+// name in SPACK_SHORT_SPEC.
+static int pgo_profile_dir(char *dir) {
+    char const *base = getenv("SPACK_PGO_DIR");
+    if (base == NULL)
+        return 0;
+    char const *pkg = getenv("SPACK_PGO_PACKAGE");
+    size_t pkg_len = 0;
+    if (pkg != NULL) {
+        pkg_len = strlen(pkg);
+    } else if ((pkg = getenv("SPACK_SHORT_SPEC")) != NULL) {
+        pkg_len = strcspn(pkg, "@%+~ ");
+    }
+    size_t base_len = strlen(base);
+    if (base_len + pkg_len + 2 > SPACK_PATH_MAX)
+        return 0;
+    memcpy(dir, base, base_len);
+    if (pkg_len > 0) {
+        dir[base_len++] = '/';
+        memcpy(dir + base_len, pkg, pkg_len);
+    }
+    dir[base_len + pkg_len] = '\0';
+    return 1;
+}
+
+// Merge dir/*.profraw into profdata with llvm-profdata. Returns whether it did.
+static int pgo_merge(char const *dir, char const *profdata) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+
+    struct string_table_t strings;
+    struct offset_list_t files;
+    string_table_init(&strings);
+    offset_list_init(&files);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (len < 8 || strcmp(e->d_name + len - 8, ".profraw") != 0)
+            continue;
+        size_t offset = string_table_store_n(&strings, dir, strlen(dir));
+        string_table_store_flag(&strings, "/", e->d_name);
+        offset_list_push(&files, offset);
+    }
+    closedir(d);
+
+    char tmp[SPACK_PATH_MAX];
+    if (files.n == 0 || snprintf(tmp, sizeof(tmp), "%s.%d", profdata, (int)getpid()) >=
+                            (int)sizeof(tmp)) {
+        free(strings.arr);
+        free(files.offsets);
+        return 0;
+    }
+
+    char const *tool = getenv("SPACK_LLVM_PROFDATA");
+    size_t tool_offset;
+    if (tool != NULL) {
+        tool_offset = string_table_store(&strings, tool);
+    } else {
+        char const *cc = getenv("SPACK_CC");
+        cc = cc == NULL ? "" : cc;
+        tool_offset = string_table_store_n(&strings, cc, get_filename(cc) - cc);
+        string_table_store(&strings, "llvm-profdata");
+    }
+
+    char **argv = malloc((files.n + 5) * sizeof(char *));
+    argv[0] = strings.arr + tool_offset;
+    argv[1] = "merge";
+    argv[2] = "-o";
+    argv[3] = tmp;
+    for (size_t j = 0; j < files.n; ++j)
+        argv[4 + j] = strings.arr + files.offsets[j];
+    argv[4 + files.n] = NULL;
+
+    // We may have inherited an ignored SIGCHLD, which would make waitpid fail.
+    struct sigaction dfl, old;
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &dfl, &old);
+    typeof(posix_spawn) *spawn = dlsym(RTLD_NEXT, "posix_spawn");
+    pid_t pid;
+    int status;
+    int ok = spawn(&pid, argv[0], NULL, NULL, argv, environ) == 0 &&
+             waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0 && rename(tmp, profdata) == 0;
+    sigaction(SIGCHLD, &old, NULL);
+    if (!ok) {
+        fprintf(stderr, "spack-compiler-wrapper: failed to merge profiles in %s\n",
+                dir);
+        unlink(tmp);
+    }
+
+    free(argv);
+    free(strings.arr);
+    free(files.offsets);
+    return ok;
+}
+
+// Merge the profiles once: the first compile takes the lock and merges, the
+// others wait for it and use the result. Remove profdata to merge again.
+// Returns whether there is a profile to use.
+static int pgo_merge_profiles(char const *dir, char const *profdata) {
+    struct stat st;
+    char lock[SPACK_PATH_MAX];
+    if (snprintf(lock, sizeof(lock), "%s.lock", profdata) >= (int)sizeof(lock))
+        return 0;
+    int fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return 0;
+    int ok = flock(fd, LOCK_EX) == 0 &&
+             (stat(profdata, &st) == 0 || pgo_merge(dir, profdata));
+    close(fd);
+    return ok;
+}
+
+// -fprofile-generate / -fprofile-use for SPACK_PGO. Stale or missing profiles
+// are reported as warnings, never as errors. Clang profiles are merged by the
+// first compile that is run, also when it's posix_spawned: that blocks the build
+// tool once, for as long as the other compiles wait for the merge anyway.
+static void parse_pgo(struct state_t *s) {
+    enum pgo_t pgo = pgo_mode();
+    if (pgo == SPACK_PGO_NONE)
+        return;
+    if (s->mode != SPACK_MODE_CC && s->mode != SPACK_MODE_CCLD)
+        return;
+
+    char dir[SPACK_PATH_MAX];
+    if (!pgo_profile_dir(dir))
+        return;
+
+    if (pgo == SPACK_PGO_GENERATE) {
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store_flag(&s->strings, "-fprofile-generate=",
+                                                 dir));
+        return;
+    }
+
+    if (compiler_family(override_path(s->type)) == SPACK_FAMILY_CLANG) {
+        char profdata[SPACK_PATH_MAX];
+        struct stat st;
+        if (snprintf(profdata, sizeof(profdata), "%s/default.profdata", dir) >=
+            (int)sizeof(profdata))
+            return;
+        if (stat(profdata, &st) != 0 &&
+            (s->context == SPACK_CONTEXT_API || !pgo_merge_profiles(dir, profdata))) {
+            fprintf(stderr,
+                    "spack-compiler-wrapper: warning: no profile %s, leaving out "
+                    "-fprofile-use\n",
+                    profdata);
+            return;
+        }
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store_flag(&s->strings, "-fprofile-use=",
+                                                 profdata));
+        offset_list_push(
+            &s->spack_compiler_flags,
+            string_table_store(&s->strings, "-Wno-error=profile-instr-out-of-date"));
+        offset_list_push(
+            &s->spack_compiler_flags,
+            string_table_store(&s->strings, "-Wno-error=profile-instr-unprofiled"));
+        offset_list_push(
+            &s->spack_compiler_flags,
+            string_table_store(&s->strings, "-Wno-error=profile-instr-missing"));
+    } else {
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store_flag(&s->strings, "-fprofile-use=", dir));
+        offset_list_push(&s->spack_compiler_flags,
+                         string_table_store(&s->strings, "-fprofile-correction"));
+        offset_list_push(
+            &s->spack_compiler_flags,
+            string_table_store(&s->strings, "-Wno-error=coverage-mismatch"));
+        offset_list_push(
+            &s->spack_compiler_flags,
+            string_table_store(&s->strings, "-Wno-error=missing-profile"));
+    }
+}
+
 static void parse_spack_env(struct state_t *s) {
     const char *dtags;
     switch (s->type) {
@@ -616,26 +1035,28 @@ static void parse_spack_env(struct state_t *s) {
                             &s->spack_compiler_flags);
         store_delimited_flags(getenv("SPACK_INCLUDE_DIRS"), ':', "-I", &s->strings,
                               &s->spack_include_flags);
+        parse_lto(s);
+        parse_pgo(s);
+        break;
+    case SPACK_LD:
+        parse_lto(s);
         break;
     default:
         break;
     }
 }
 
-static void copy_env(struct string_table_t *strings, struct offset_list_t *env_offsets,
-                     char *const *envp) {
-    for (char *const *env = envp; *env != NULL; ++env)
-        offset_list_push(env_offsets, string_table_store(strings, *env));
-}
-
-static struct new_args rewrite_args_and_env(char *const *argv, char *const *envp,
-                                            struct state_t *s) {
-    struct new_args args;
-    arg_parse_init(s);
-
-    // Store the actual compiler
-    s->offset_compiler_or_linker =
-        string_table_store(&s->strings, override_path(s->type));
+// The part of the rewrite that only depends on the type, mode and environment.
+static void rewrite_prologue(struct state_t *s) {
+    // Store the actual compiler, or gcc-ar/llvm-ar next to SPACK_CC.
+    if (archiver_type(s->type) && getenv(get_spack_variable(s->type)) == NULL) {
+        char path[SPACK_PATH_MAX] = "";
+        archiver_path(s->type, path);
+        s->offset_compiler_or_linker = string_table_store(&s->strings, path);
+    } else {
+        s->offset_compiler_or_linker =
+            string_table_store(&s->strings, override_path(s->type));
+    }
 
     // Maybe store ccache path.
     if (s->type == SPACK_CC || s->type == SPACK_CXX) {
@@ -648,6 +1069,211 @@ static struct new_args rewrite_args_and_env(char *const *argv, char *const *envp
         }
     }
 
+    parse_spack_env(s);
+}
+
+static int should_intercept(const char *path, char *const *argv, struct state_t *s) {
+    // Disable if not a compiler or linker
+    s->type = compiler_type(get_filename(path));
+    if (s->type == SPACK_NONE)
+        return 0;
+
+    // Disable if we already wrapped it
+    if (s->type == SPACK_LD && getenv("SPACK_LD_DONE") != NULL)
+        return 0;
+    if ((s->type == SPACK_CC || s->type == SPACK_CXX || s->type == SPACK_F77 ||
+         s->type == SPACK_FC) &&
+        getenv("SPACK_CC_DONE") != NULL)
+        return 0;
+
+    // Only swap in an LTO-aware archiver with SPACK_LTO, and if there is one.
+    if (archiver_type(s->type)) {
+        char archiver[SPACK_PATH_MAX];
+        if (lto_mode() == SPACK_LTO_NONE || getenv("SPACK_AR_DONE") != NULL)
+            return 0;
+        if (getenv(get_spack_variable(s->type)) == NULL &&
+            !archiver_path(s->type, archiver))
+            return 0;
+    }
+
+    // Quickly scan for clang -cc1 type of args; we shouldn't wrap those.
+    parse_compile_mode(argv, s);
+
+    return s->mode != SPACK_MODE_INTERNAL && s->mode != SPACK_MODE_VERSION;
+}
+
+// In-process API, see spack-compiler-wrapper.h. It is built into
+// libspack-rewrite.so, without the exec* and posix_spawn wrappers.
+
+#ifdef SPACK_REWRITE_LIBRARY
+
+// Clear the state, but keep the buffers around.
+static void arg_parse_reset(struct state_t *s) {
+    s->strings.n = 0;
+
+    s->spack_compiler_flags.n = 0;
+
+    s->isystem_include_flags.n = 0;
+    s->include_flags.n = 0;
+    s->spack_include_flags.n = 0;
+    s->isystem_system_include_flags.n = 0;
+    s->system_include_flags.n = 0;
+
+    s->lib_flags.n = 0;
+    s->spack_lib_flags.n = 0;
+    s->system_lib_flags.n = 0;
+
+    s->rpath_flags.n = 0;
+    s->spack_rpath_flags.n = 0;
+    s->system_rpath_flags.n = 0;
+
+    s->other_flags.n = 0;
+
+    s->env.n = 0;
+    s->has_ccache = 0;
+}
+
+struct spack_rewriter_t {
+    // rewrite_prologue per executable type and mode, computed on first use;
+    // ready is 1 when computed, -1 when the SPACK_* variable is not set.
+    struct state_t prologue[SPACK_NONE][SPACK_MODE_INTERNAL + 1];
+    int ready[SPACK_NONE][SPACK_MODE_INTERNAL + 1];
+
+    struct state_t s;
+    char **argv;
+    size_t argv_capacity;
+};
+
+static void arg_parse_free(struct state_t *s) {
+    free(s->strings.arr);
+    free(s->spack_compiler_flags.offsets);
+    free(s->isystem_include_flags.offsets);
+    free(s->include_flags.offsets);
+    free(s->spack_include_flags.offsets);
+    free(s->isystem_system_include_flags.offsets);
+    free(s->system_include_flags.offsets);
+    free(s->lib_flags.offsets);
+    free(s->spack_lib_flags.offsets);
+    free(s->system_lib_flags.offsets);
+    free(s->rpath_flags.offsets);
+    free(s->spack_rpath_flags.offsets);
+    free(s->system_rpath_flags.offsets);
+    free(s->other_flags.offsets);
+    free(s->env.offsets);
+}
+
+static void offset_list_copy(struct offset_list_t *dst,
+                             struct offset_list_t const *src) {
+    for (size_t j = 0; j < src->n; ++j)
+        offset_list_push(dst, src->offsets[j]);
+}
+
+// Start from a computed prologue: since the strings are copied as a whole, the
+// offsets remain valid.
+static void state_copy_prologue(struct state_t *dst, struct state_t const *src) {
+    arg_parse_reset(dst);
+    string_table_store_n(&dst->strings, src->strings.arr, src->strings.n);
+    offset_list_copy(&dst->spack_compiler_flags, &src->spack_compiler_flags);
+    offset_list_copy(&dst->spack_include_flags, &src->spack_include_flags);
+    offset_list_copy(&dst->spack_lib_flags, &src->spack_lib_flags);
+    offset_list_copy(&dst->spack_rpath_flags, &src->spack_rpath_flags);
+    dst->context = src->context;
+    dst->has_ccache = src->has_ccache;
+    dst->offset_ccache = src->offset_ccache;
+    dst->offset_compiler_or_linker = src->offset_compiler_or_linker;
+    dst->system_dirs = src->system_dirs;
+}
+
+__attribute__((visibility("default"))) struct spack_rewriter_t *
+spack_rewriter_create(void) {
+    struct spack_rewriter_t *r = calloc(1, sizeof(struct spack_rewriter_t));
+    if (r == NULL)
+        return NULL;
+    arg_parse_init(&r->s);
+    return r;
+}
+
+__attribute__((visibility("default"))) void
+spack_rewriter_destroy(struct spack_rewriter_t *r) {
+    if (r == NULL)
+        return;
+    for (size_t t = 0; t < SPACK_NONE; ++t)
+        for (size_t m = 0; m <= SPACK_MODE_INTERNAL; ++m)
+            if (r->ready[t][m] == 1)
+                arg_parse_free(&r->prologue[t][m]);
+    arg_parse_free(&r->s);
+    free(r->argv);
+    free(r);
+}
+
+__attribute__((visibility("default"))) char *const *
+spack_rewrite_args(struct spack_rewriter_t *r, char *const *argv) {
+    struct state_t *s = &r->s;
+    if (argv[0] == NULL || !should_intercept(argv[0], argv, s))
+        return NULL;
+
+    int *ready = &r->ready[s->type][s->mode];
+    struct state_t *prologue = &r->prologue[s->type][s->mode];
+    if (*ready == 0) {
+        if (!archiver_type(s->type) && getenv(get_spack_variable(s->type)) == NULL) {
+            *ready = -1;
+        } else {
+            prologue->type = s->type;
+            prologue->mode = s->mode;
+            prologue->context = SPACK_CONTEXT_API;
+            arg_parse_init(prologue);
+            rewrite_prologue(prologue);
+            *ready = 1;
+        }
+    }
+    if (*ready < 0)
+        return NULL;
+
+    state_copy_prologue(s, prologue);
+    parse_argv(argv, s);
+    parse_lto_link(s, argv);
+
+    size_t n = arg_parse_count(s);
+    if (n > r->argv_capacity) {
+        char **new_argv = realloc(r->argv, 2 * n * sizeof(char *));
+        if (new_argv == NULL)
+            return NULL;
+        r->argv = new_argv;
+        r->argv_capacity = 2 * n;
+    }
+    arg_parse_fill(s, r->argv);
+    return r->argv;
+}
+
+#else
+
+static char *const *arg_parse_finish(struct state_t const *s) {
+    char **argv = malloc(arg_parse_count(s) * sizeof(char *));
+    arg_parse_fill(s, argv);
+    return argv;
+}
+
+// create env
+static char *const *env_finish(struct state_t const *s) {
+    char **env = malloc((s->env.n + 1) * sizeof(char *));
+    for (size_t j = 0; j < s->env.n; ++j)
+        env[j] = s->strings.arr + s->env.offsets[j];
+    env[s->env.n] = NULL;
+    return env;
+}
+
+static void copy_env(struct string_table_t *strings, struct offset_list_t *env_offsets,
+                     char *const *envp) {
+    for (char *const *env = envp; *env != NULL; ++env)
+        offset_list_push(env_offsets, string_table_store(strings, *env));
+}
+
+static struct new_args rewrite_args_and_env(char *const *argv, char *const *envp,
+                                            struct state_t *s) {
+    struct new_args args;
+    arg_parse_init(s);
+    rewrite_prologue(s);
+
     // Copy the environment variables
     copy_env(&s->strings, &s->env, envp);
 
@@ -659,8 +1285,12 @@ static struct new_args rewrite_args_and_env(char *const *argv, char *const *envp
     if (s->type == SPACK_LD)
         offset_list_push(&s->env, string_table_store(&s->strings, "SPACK_LD_DONE=1"));
 
-    parse_spack_env(s);
+    // gcc-ar execs ar itself.
+    if (archiver_type(s->type))
+        offset_list_push(&s->env, string_table_store(&s->strings, "SPACK_AR_DONE=1"));
+
     parse_argv(argv, s);
+    parse_lto_link(s, argv);
 
     args.argv = arg_parse_finish(s);
     args.env = env_finish(s);
@@ -688,26 +1318,6 @@ static struct new_args rewrite_args_and_env(char *const *argv, char *const *envp
     }
 }
 
-static int should_intercept(const char *path, char *const *argv, struct state_t *s) {
-    // Disable if not a compiler or linker
-    s->type = compiler_type(get_filename(path));
-    if (s->type == SPACK_NONE)
-        return 0;
-
-    // Disable if we already wrapped it
-    if (s->type == SPACK_LD && getenv("SPACK_LD_DONE") != NULL)
-        return 0;
-    if ((s->type == SPACK_CC || s->type == SPACK_CXX || s->type == SPACK_F77 ||
-         s->type == SPACK_FC) &&
-        getenv("SPACK_CC_DONE") != NULL)
-        return 0;
-
-    // Quickly scan for clang -cc1 type of args; we shouldn't wrap those.
-    parse_compile_mode(argv, s);
-
-    return s->mode != SPACK_MODE_INTERNAL && s->mode != SPACK_MODE_VERSION;
-}
-
 static void maybe_debug(struct state_t const *s, const char *path, char *const *args_in,
                         char *const *args_out) {
     if (getenv("SPACK_DEBUG") == NULL)
@@ -747,11 +1357,13 @@ static void maybe_debug(struct state_t const *s, const char *path, char *const *
     char const *mode =
         s->type == SPACK_LD
             ? "[ld] "
-            : s->mode == SPACK_MODE_AS
-                  ? "[as] "
-                  : s->mode == SPACK_MODE_CC
-                        ? "[cc] "
-                        : s->mode == SPACK_MODE_CCLD ? "[ccld] " : "[cpp]";
+            : archiver_type(s->type)
+                  ? "[ar] "
+                  : s->mode == SPACK_MODE_AS
+                        ? "[as] "
+                        : s->mode == SPACK_MODE_CC
+                              ? "[cc] "
+                              : s->mode == SPACK_MODE_CCLD ? "[ccld] " : "[cpp]";
     fputs(mode, in);
     for (char *const *arg_in = args_in; *arg_in != NULL; ++arg_in) {
         fputs(*arg_in, in);
@@ -769,27 +1381,1348 @@ static void maybe_debug(struct state_t const *s, const char *path, char *const *
     fclose(out);
 }
 
+// Running commands under supervision of the wrapper
+
+// Exit the way the command that produced the wait status did.
+static void exit_like(int status) {
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+    }
+    _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+// Run a command to completion without wrapping it again, with stdout and stderr
+// redirected to out and err unless they're -1; returns the wait status.
+static int run_command_io(char *const *argv, char *const *env, int out, int err) {
+    typeof(execve) *next = dlsym(RTLD_NEXT, "execve");
+    // We may have inherited an ignored SIGCHLD, which would make waitpid fail.
+    struct sigaction dfl, old;
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &dfl, &old);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigaction(SIGCHLD, &old, NULL);
+        if ((out >= 0 && dup2(out, 1) < 0) || (err >= 0 && dup2(err, 2) < 0))
+            _exit(127);
+        next(argv[0], argv, env);
+        perror(argv[0]);
+        _exit(127);
+    }
+    int status;
+    pid_t res = pid;
+    if (pid > 0)
+        while ((res = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+            ;
+    sigaction(SIGCHLD, &old, NULL);
+    if (pid < 0 || res != pid)
+        return W_EXITCODE(1, 0);
+    return status;
+}
+
+static int run_command(char *const *argv, char *const *env) {
+    return run_command_io(argv, env, -1, -1);
+}
+
+// Flags that take their value as a separate argument.
+static int flag_takes_value(const char *arg) {
+    static const char *flags[] = {
+        "-o",          "-x",          "-MF",          "-MT",
+        "-MQ",         "-include",    "-imacros",     "-isystem",
+        "-idirafter",  "-iprefix",    "-iquote",      "-isysroot",
+        "-iwithprefix", "-iwithprefixbefore", "-I",   "-D",
+        "-U",          "-L",          "-l",           "-u",
+        "-T",          "-J",          "-Xlinker",     "-Xpreprocessor",
+        "-Xassembler", "-Xclang",     "-aux-info",    "--param",
+        "-arch",       "-target",     "-z",           "-e",
+        "-module"};
+    for (size_t j = 0; j < sizeof(flags) / sizeof(char *); ++j)
+        if (strcmp(arg, flags[j]) == 0)
+            return 1;
+    return 0;
+}
+
+// .i or .ii for C and C++ sources respectively.
+static const char *preprocessed_suffix(const char *file) {
+    static const char *cxx[] = {".cc", ".cp", ".cpp", ".cxx", ".c++", ".C", ".CPP"};
+    const char *ext = strrchr(get_filename(file), '.');
+    if (ext == NULL)
+        return NULL;
+    if (strcmp(ext, ".c") == 0)
+        return ".i";
+    for (size_t j = 0; j < sizeof(cxx) / sizeof(char *); ++j)
+        if (strcmp(ext, cxx[j]) == 0)
+            return ".ii";
+    return NULL;
+}
+
+// Flags that only matter to the preprocessor: -I, -D, -U, -M*, -i*, -Wp,.
+static int preprocessor_flag(const char *arg) {
+    return strncmp(arg, "-I", 2) == 0 || strncmp(arg, "-D", 2) == 0 ||
+           strncmp(arg, "-U", 2) == 0 || strncmp(arg, "-M", 2) == 0 ||
+           strncmp(arg, "-i", 2) == 0 || strncmp(arg, "-Wp,", 4) == 0 ||
+           strncmp(arg, "-nostdinc", 9) == 0;
+}
+
+// Flags that produce or consume files beside the object file; those compiles
+// stay local. Profile files are named after the object file's path.
+static int local_only_flag(const char *arg) {
+    return strcmp(arg, "-x") == 0 || strncmp(arg, "-save-temps", 11) == 0 ||
+           strcmp(arg, "-gsplit-dwarf") == 0 || strcmp(arg, "--coverage") == 0 ||
+           strcmp(arg, "-ftest-coverage") == 0 || strcmp(arg, "-fprofile-arcs") == 0 ||
+           strncmp(arg, "-fprofile-generate", 18) == 0 ||
+           strncmp(arg, "-fprofile-instr-generate", 24) == 0 ||
+           strncmp(arg, "-fcs-profile-generate", 21) == 0 ||
+           strncmp(arg, "-fprofile-use", 13) == 0 ||
+           strncmp(arg, "-fprofile-instr-use", 19) == 0 ||
+           strcmp(arg, "-fsyntax-only") == 0 || strncmp(arg, "-fdump-", 7) == 0;
+}
+
+struct offload_t {
+    const char *output;
+    const char *source;
+    const char *suffix;
+    int has_md;
+    int has_mf;
+    int has_mt;
+};
+
+static int offload_scan(char *const *argv, struct offload_t *o) {
+    memset(o, 0, sizeof(*o));
+    for (size_t j = 1; argv[j] != NULL; ++j) {
+        char *arg = argv[j];
+        if (arg[0] == '@' || strcmp(arg, "-") == 0 || local_only_flag(arg))
+            return 0;
+        if (arg[0] != '-') {
+            if (o->source != NULL || (o->suffix = preprocessed_suffix(arg)) == NULL)
+                return 0;
+            o->source = arg;
+            continue;
+        }
+        if (strcmp(arg, "-o") == 0) {
+            o->output = argv[j + 1];
+        } else if (strncmp(arg, "-o", 2) == 0) {
+            o->output = arg + 2;
+        } else if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0) {
+            o->has_md = 1;
+        } else if (strncmp(arg, "-MF", 3) == 0) {
+            o->has_mf = 1;
+        } else if (strncmp(arg, "-MT", 3) == 0 || strncmp(arg, "-MQ", 3) == 0) {
+            o->has_mt = 1;
+        }
+        if (flag_takes_value(arg) && argv[++j] == NULL)
+            return 0;
+    }
+    // -MD without -MF would name the dependency file after the preprocessed file.
+    return o->output != NULL && o->source != NULL && (!o->has_md || o->has_mf);
+}
+
+static int executor_connect(const char *executor) {
+    int fd;
+    if (strchr(executor, '/') != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(executor) >= sizeof(addr.sun_path))
+            return -1;
+        strcpy(addr.sun_path, executor);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        return -1;
+    }
+
+    // host:port
+    char host[256];
+    char const *port = strrchr(executor, ':');
+    if (port == NULL || (size_t)(port - executor) >= sizeof(host))
+        return -1;
+    memcpy(host, executor, port - executor);
+    host[port - executor] = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port + 1, &hints, &res) != 0)
+        return -1;
+    fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                         ai->ai_protocol)) < 0)
+            continue;
+        // Don't hang on an unreachable executor.
+        struct timeval timeout = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            timeout.tv_sec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_request(int fd, char *const *argv, struct offload_t const *o,
+                        char const *unit, size_t unit_len) {
+    char cwd[SPACK_PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+
+    // The compile flags, without preprocessor flags, -o and the source.
+    uint32_t argc = 0;
+    for (size_t j = 0; argv[j] != NULL; ++j)
+        ++argc;
+    char const **remote = malloc(argc * sizeof(char *));
+    uint32_t n = 0;
+    for (size_t j = 0; argv[j] != NULL; ++j) {
+        char *arg = argv[j];
+        int skip = j > 0 && (arg == o->source || strncmp(arg, "-o", 2) == 0 ||
+                             preprocessor_flag(arg));
+        if (!skip)
+            remote[n++] = arg;
+        if (j > 0 && arg[0] == '-' && flag_takes_value(arg) && argv[j + 1] != NULL) {
+            ++j;
+            if (!skip)
+                remote[n++] = argv[j];
+        }
+    }
+
+    int err = spack_send_all(fd, SPACK_EXECUTOR_MAGIC, 4) != 0 ||
+              spack_send_u32(fd, SPACK_EXECUTOR_VERSION) != 0 ||
+              spack_send_u32(fd, n) != 0;
+    for (uint32_t j = 0; j < n && !err; ++j)
+        err = spack_send_bytes(fd, remote[j], strlen(remote[j])) != 0;
+    err = err || spack_send_bytes(fd, cwd, strlen(cwd)) != 0 ||
+          spack_send_bytes(fd, o->suffix, strlen(o->suffix)) != 0 ||
+          spack_send_bytes(fd, unit, unit_len) != 0;
+    free(remote);
+    return err ? -1 : 0;
+}
+
+// With SPACK_REMOTE_EXECUTOR=<socket path> or <host>:<port>, preprocess locally
+// and compile on the executor. Does not return when the executor did the
+// compile; returns to fall back to a local compile.
+static void maybe_offload(struct state_t const *s, struct new_args args) {
+    char const *executor = getenv("SPACK_REMOTE_EXECUTOR");
+    if (executor == NULL || s->mode != SPACK_MODE_CC || s->has_ccache ||
+        (s->type != SPACK_CC && s->type != SPACK_CXX))
+        return;
+
+    struct offload_t o;
+    if (!offload_scan(args.argv, &o))
+        return;
+
+    int fd = executor_connect(executor);
+    if (fd < 0)
+        return;
+
+    // Fall back to a local compile when the executor hangs.
+    char const *timeout_env = getenv("SPACK_REMOTE_EXECUTOR_TIMEOUT");
+    struct timeval timeout = {timeout_env ? atoi(timeout_env) : 300, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char const *tmpdir = getenv("TMPDIR");
+    char unit_path[SPACK_PATH_MAX];
+    if (snprintf(unit_path, sizeof(unit_path), "%s/spack-cc-XXXXXX%s",
+                 tmpdir ? tmpdir : "/tmp", o.suffix) >= (int)sizeof(unit_path)) {
+        close(fd);
+        return;
+    }
+    int unit_fd = mkstemps(unit_path, strlen(o.suffix));
+    if (unit_fd < 0) {
+        close(fd);
+        return;
+    }
+
+    // Preprocess: the same command without -o, plus -E -o <unit>.
+    size_t argc = 0;
+    while (args.argv[argc] != NULL)
+        ++argc;
+    char **pp = malloc((argc + 6) * sizeof(char *));
+    size_t n = 0;
+    for (size_t j = 0; j < argc; ++j) {
+        if (j > 0 && strcmp(args.argv[j], "-o") == 0) {
+            ++j;
+            continue;
+        }
+        if (j > 0 && strncmp(args.argv[j], "-o", 2) == 0)
+            continue;
+        pp[n++] = args.argv[j];
+    }
+    pp[n++] = "-E";
+    pp[n++] = "-o";
+    pp[n++] = unit_path;
+    if (o.has_md && !o.has_mt) {
+        pp[n++] = "-MQ";
+        pp[n++] = (char *)o.output;
+    }
+    pp[n] = NULL;
+
+    int status = run_command(pp, args.env);
+    free(pp);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        unlink(unit_path);
+        exit_like(status);
+    }
+
+    struct stat st;
+    char const *unit = NULL;
+    if (fstat(unit_fd, &st) == 0)
+        unit = st.st_size == 0 ? "" : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                           unit_fd, 0);
+    close(unit_fd);
+    unlink(unit_path);
+
+    uint32_t remote_status;
+    uint64_t out_len, err_len, obj_len;
+    char magic[4];
+    char *out = NULL, *err = NULL, *obj = NULL;
+    int ok = unit != NULL && unit != MAP_FAILED &&
+             send_request(fd, args.argv, &o, unit, st.st_size) == 0 &&
+             spack_read_all(fd, magic, 4) == 0 &&
+             memcmp(magic, SPACK_EXECUTOR_MAGIC, 4) == 0 &&
+             spack_recv_u32(fd, &remote_status) == 0 &&
+             (out = spack_recv_bytes(fd, &out_len)) != NULL &&
+             (err = spack_recv_bytes(fd, &err_len)) != NULL &&
+             (obj = spack_recv_bytes(fd, &obj_len)) != NULL;
+    close(fd);
+
+    // Compile locally when the executor went away or couldn't run the compiler.
+    if (!ok || remote_status == SPACK_EXECUTOR_ERROR || remote_status == 127 ||
+        remote_status >= 128) {
+        free(out);
+        free(err);
+        free(obj);
+        return;
+    }
+
+    spack_write_all(1, out, out_len);
+    spack_write_all(2, err, err_len);
+    if (remote_status == 0) {
+        int obj_fd = open(o.output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (obj_fd < 0 || spack_write_all(obj_fd, obj, obj_len) != 0 ||
+            close(obj_fd) != 0) {
+            perror(o.output);
+            _exit(1);
+        }
+    }
+    _exit(remote_status);
+}
+
+static int fortran_file(const char *file) {
+    static const char *exts[] = {".f",   ".F",   ".for", ".f77", ".f90", ".F90",
+                                 ".f95", ".F95", ".f03", ".F03", ".f08", ".F08"};
+    const char *ext = strrchr(get_filename(file), '.');
+    if (ext == NULL)
+        return 0;
+    for (size_t j = 0; j < sizeof(exts) / sizeof(char *); ++j)
+        if (strcmp(ext, exts[j]) == 0)
+            return 1;
+    return 0;
+}
+
+// Sources the compiler driver compiles one at a time.
+static int source_file(const char *file) {
+    static const char *exts[] = {".s", ".S", ".sx", ".m", ".mm"};
+    if (preprocessed_suffix(file) != NULL || fortran_file(file))
+        return 1;
+    const char *ext = strrchr(get_filename(file), '.');
+    if (ext == NULL)
+        return 0;
+    for (size_t j = 0; j < sizeof(exts) / sizeof(char *); ++j)
+        if (strcmp(ext, exts[j]) == 0)
+            return 1;
+    return 0;
+}
+
+// GNU make jobserver from MAKEFLAGS: --jobserver-auth=R,W, --jobserver-fds=R,W or
+// --jobserver-auth=fifo:PATH. The read end is opened separately in non-blocking
+// mode, so waiting for a token never blocks.
+struct jobserver_t {
+    int read_fd;
+    int write_fd;
+};
+
+// Returns 0 when there is no limit, 1 when the jobserver is usable, -1 when make
+// wants us to run a single job. The jobserver fds are only valid in recursive
+// recipes; otherwise make closes them and they may be reused for other files.
+static int jobserver_open(struct jobserver_t *js) {
+    char const *flags = getenv("MAKEFLAGS");
+    char const *auth = NULL;
+    size_t auth_len = 0;
+    int unlimited = 0;
+    // Words are separated by unescaped spaces; variable definitions follow "--".
+    for (char const *p = flags; p != NULL && *p != '\0';) {
+        while (*p == ' ')
+            ++p;
+        char const *end = p;
+        while (*end != '\0' && *end != ' ')
+            end += end[0] == '\\' && end[1] != '\0' ? 2 : 1;
+        size_t len = end - p;
+        if (len == 2 && strncmp(p, "--", 2) == 0)
+            break;
+        if (len >= 17 && strncmp(p, "--jobserver-auth=", 17) == 0) {
+            auth = p + 17;
+            auth_len = len - 17;
+        } else if (len >= 16 && strncmp(p, "--jobserver-fds=", 16) == 0) {
+            auth = p + 16;
+            auth_len = len - 16;
+        } else if (len == 2 && strncmp(p, "-j", 2) == 0) {
+            unlimited = 1;
+        }
+        p = end;
+    }
+    // Without a jobserver, make runs jobs one at a time unless it's unlimited -j.
+    if (auth == NULL)
+        return flags == NULL || unlimited ? 0 : -1;
+
+    char path[SPACK_PATH_MAX];
+    struct stat r_st, w_st;
+    if (auth_len >= 5 && strncmp(auth, "fifo:", 5) == 0) {
+        if (auth_len - 5 >= sizeof(path))
+            return -1;
+        memcpy(path, auth + 5, auth_len - 5);
+        path[auth_len - 5] = '\0';
+        js->read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        js->write_fd = open(path, O_WRONLY | O_CLOEXEC);
+    } else {
+        // Both ends of the same pipe.
+        int r, w;
+        if (sscanf(auth, "%d,%d", &r, &w) != 2 || r < 0 || w < 0 ||
+            fstat(r, &r_st) != 0 || fstat(w, &w_st) != 0 || !S_ISFIFO(r_st.st_mode) ||
+            !S_ISFIFO(w_st.st_mode) || r_st.st_ino != w_st.st_ino ||
+            r_st.st_dev != w_st.st_dev)
+            return -1;
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", r);
+        js->read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        js->write_fd = w;
+    }
+    if (js->read_fd >= 0 && js->write_fd >= 0 && fstat(js->read_fd, &r_st) == 0 &&
+        S_ISFIFO(r_st.st_mode))
+        return 1;
+    if (js->read_fd >= 0)
+        close(js->read_fd);
+    if (js->write_fd >= 0 && auth_len >= 5 && strncmp(auth, "fifo:", 5) == 0)
+        close(js->write_fd);
+    return -1;
+}
+
+static void copy_fd(int from, int to) {
+    char buf[4096];
+    ssize_t n;
+    lseek(from, 0, SEEK_SET);
+    while ((n = read(from, buf, sizeof(buf))) > 0)
+        if (spack_write_all(to, buf, n) != 0)
+            break;
+}
+
+struct split_job_t {
+    pid_t pid;
+    int out;
+    int err;
+    int status;
+    int token; // byte taken from the jobserver, -1 for our own job slot
+};
+
+// Give back the job slot or jobserver token of a finished compile.
+static void split_release(struct split_job_t const *job, int *own_slot_free,
+                          struct jobserver_t const *js) {
+    if (job->token < 0) {
+        *own_slot_free = 1;
+    } else {
+        unsigned char token = job->token;
+        spack_write_all(js->write_fd, &token, 1);
+    }
+}
+
+// With SPACK_SPLIT_JOBS=<n>, run `cc -c a.c b.c ...` without -o as one compile
+// per source, at most n at a time and within the make jobserver's tokens. The
+// output of each compile is printed as a whole, in the order of the sources. Does
+// not return when the compiles ran.
+static void maybe_split(struct state_t const *s, struct new_args args) {
+    char const *jobs_env = getenv("SPACK_SPLIT_JOBS");
+    if (jobs_env == NULL || s->mode != SPACK_MODE_CC)
+        return;
+    long max_jobs = strtol(jobs_env, NULL, 10);
+    if (max_jobs < 2)
+        return;
+
+    // Find the sources; anything that makes per-file compiles differ from the
+    // original command keeps it as is. Fortran sources may use modules written by
+    // the ones before them, so they're compiled in order.
+    size_t first = s->has_ccache ? 2 : 1;
+    size_t argc = 0, n_sources = 0;
+    while (args.argv[argc] != NULL)
+        ++argc;
+    for (size_t j = first; j < argc; ++j) {
+        char const *arg = args.argv[j];
+        if (arg[0] == '@' || strcmp(arg, "-") == 0 || strncmp(arg, "-o", 2) == 0 ||
+            strcmp(arg, "-x") == 0 || strncmp(arg, "-MF", 3) == 0 ||
+            strncmp(arg, "-MT", 3) == 0 || strncmp(arg, "-MQ", 3) == 0)
+            return;
+        if (arg[0] != '-') {
+            if (!source_file(arg) || fortran_file(arg))
+                return;
+            ++n_sources;
+        } else if (flag_takes_value(arg) && j + 1 < argc) {
+            ++j;
+        }
+    }
+    if (n_sources < 2)
+        return;
+
+    struct jobserver_t js;
+    int has_jobserver = jobserver_open(&js);
+    if (has_jobserver < 0)
+        return;
+
+    // Per-source argv: the flags, and the source at the end.
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    size_t *sources = malloc(n_sources * sizeof(size_t));
+    struct split_job_t *jobs = calloc(n_sources, sizeof(struct split_job_t));
+    size_t n_flags = 0;
+    n_sources = 0;
+    for (size_t j = 0; j < argc; ++j) {
+        char *arg = args.argv[j];
+        if (j >= first && arg[0] != '-') {
+            sources[n_sources++] = j;
+            continue;
+        }
+        argv[n_flags++] = arg;
+        if (j >= first && flag_takes_value(arg) && j + 1 < argc)
+            argv[n_flags++] = args.argv[++j];
+    }
+    argv[n_flags + 1] = NULL;
+    // A compile that never reports back counts as failed.
+    for (size_t j = 0; j < n_sources; ++j)
+        jobs[j].status = W_EXITCODE(1, 0);
+
+    // We may have inherited an ignored SIGCHLD, which would make waitpid fail.
+    signal(SIGCHLD, SIG_DFL);
+    typeof(execve) *next = dlsym(RTLD_NEXT, "execve");
+    size_t started = 0, printed = 0;
+    long running = 0;
+    int own_slot_free = 1;
+    while (printed < n_sources) {
+        // Start as many compiles as we have job slots for.
+        while (started < n_sources && running < max_jobs) {
+            struct split_job_t *job = &jobs[started];
+            unsigned char token;
+            if (own_slot_free) {
+                job->token = -1;
+                own_slot_free = 0;
+            } else if (has_jobserver && read(js.read_fd, &token, 1) == 1) {
+                job->token = token;
+            } else if (!has_jobserver) {
+                job->token = -1;
+            } else {
+                break;
+            }
+            job->out = memfd_create("stdout", MFD_CLOEXEC);
+            job->err = memfd_create("stderr", MFD_CLOEXEC);
+            argv[n_flags] = args.argv[sources[started]];
+            job->pid = job->out < 0 || job->err < 0 ? -1 : fork();
+            if (job->pid == 0) {
+                dup2(job->out, 1);
+                dup2(job->err, 2);
+                next(argv[0], argv, args.env);
+                perror(argv[0]);
+                _exit(127);
+            }
+            if (job->pid < 0) {
+                perror(argv[0]);
+                job->status = W_EXITCODE(1, 0);
+                split_release(job, &own_slot_free, &js);
+            } else {
+                ++running;
+            }
+            ++started;
+        }
+
+        // Print finished compiles in order.
+        while (printed < started && jobs[printed].pid <= 0) {
+            struct split_job_t *job = &jobs[printed++];
+            if (job->out >= 0) {
+                copy_fd(job->out, 1);
+                close(job->out);
+            }
+            if (job->err >= 0) {
+                copy_fd(job->err, 2);
+                close(job->err);
+            }
+        }
+        if (running == 0)
+            continue;
+
+        // Wait for a compile to finish and give back its job slot.
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0 && errno == EINTR)
+            continue;
+        if (pid < 0) {
+            for (size_t j = printed; j < started; ++j)
+                if (jobs[j].pid > 0) {
+                    jobs[j].pid = 0;
+                    split_release(&jobs[j], &own_slot_free, &js);
+                }
+            running = 0;
+            continue;
+        }
+        for (size_t j = printed; j < started; ++j) {
+            if (jobs[j].pid != pid)
+                continue;
+            jobs[j].pid = 0;
+            jobs[j].status = status;
+            --running;
+            split_release(&jobs[j], &own_slot_free, &js);
+            break;
+        }
+    }
+
+    // Exit like the driver would: all files compiled, the first failure counts.
+    int status = 0;
+    for (size_t j = 0; j < n_sources; ++j)
+        if (jobs[j].status != 0) {
+            status = jobs[j].status;
+            break;
+        }
+    exit_like(status);
+}
+
+// Copy src to dst in one step, through a temporary file next to dst.
+static int copy_file(const char *src, const char *dst) {
+    char tmp[SPACK_PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.spack-XXXXXX", dst) >= (int)sizeof(tmp))
+        return -1;
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return -1;
+    int out = mkstemp(tmp);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    struct stat st;
+    char buf[65536];
+    ssize_t n;
+    int err = fstat(in, &st) != 0 || fchmod(out, st.st_mode & 07777) != 0;
+    while (!err && (n = read(in, buf, sizeof(buf))) != 0)
+        err = n < 0 || spack_write_all(out, buf, n) != 0;
+    close(in);
+    err = close(out) != 0 || err || rename(tmp, dst) != 0;
+    if (err) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Move src to dst in one step: rename within a filesystem, otherwise copy.
+static int publish_file(const char *src, const char *dst) {
+    if (rename(src, dst) == 0)
+        return 0;
+    if (errno != EXDEV || copy_file(src, dst) != 0)
+        return -1;
+    unlink(src);
+    return 0;
+}
+
+static int same_contents(const char *a, const char *b) {
+    struct stat a_st, b_st;
+    if (stat(a, &a_st) != 0 || stat(b, &b_st) != 0 || a_st.st_size != b_st.st_size)
+        return 0;
+    int a_fd = open(a, O_RDONLY | O_CLOEXEC);
+    int b_fd = open(b, O_RDONLY | O_CLOEXEC);
+    int same = a_fd >= 0 && b_fd >= 0;
+    char a_buf[4096], b_buf[4096];
+    ssize_t n;
+    while (same && (n = read(a_fd, a_buf, sizeof(a_buf))) != 0)
+        same = n > 0 && spack_read_all(b_fd, b_buf, n) == 0 &&
+               memcmp(a_buf, b_buf, n) == 0;
+    if (a_fd >= 0)
+        close(a_fd);
+    if (b_fd >= 0)
+        close(b_fd);
+    return same;
+}
+
+// Publish (or with dst_dir NULL, remove) every file in dir, and remove dir. With
+// keep_same, files identical to the ones in dst_dir are left alone, like compilers
+// do for Fortran modules, so that make doesn't rebuild what depends on them.
+static int publish_dir(const char *dir, const char *dst_dir, int keep_same) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+    int err = 0;
+    struct dirent *e;
+    char src[SPACK_PATH_MAX], dst[SPACK_PATH_MAX];
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        snprintf(src, sizeof(src), "%s/%s", dir, e->d_name);
+        if (dst_dir == NULL) {
+            unlink(src);
+        } else if (snprintf(dst, sizeof(dst), "%s/%s", dst_dir, e->d_name) >=
+                   (int)sizeof(dst)) {
+            perror(dst);
+            unlink(src);
+            err = 1;
+        } else if (keep_same && same_contents(src, dst)) {
+            unlink(src);
+        } else if (publish_file(src, dst) != 0) {
+            perror(dst);
+            unlink(src);
+            err = 1;
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+    return err;
+}
+
+// Directory of a path, "." if it has none.
+static void dir_name(const char *path, char *dir) {
+    size_t len = get_filename(path) - path;
+    if (len == 0) {
+        strcpy(dir, ".");
+        return;
+    }
+    // Keep the / of the root directory.
+    if (len > 1)
+        --len;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+}
+
+// With SPACK_OUTPUT_STAGING_DIR=<node-local dir>, let the compiler or linker write
+// -o, -MF and Fortran module outputs (and files next to -o, like .dwo and .d) to
+// a scratch directory, and move them into place once it's done. Does not return
+// when the command ran.
+static void maybe_stage(struct state_t const *s, struct new_args args) {
+    char const *root = getenv("SPACK_OUTPUT_STAGING_DIR");
+    if (root == NULL || (s->type != SPACK_LD && s->mode != SPACK_MODE_CC &&
+                         s->mode != SPACK_MODE_CCLD && s->mode != SPACK_MODE_AS))
+        return;
+
+    size_t argc = 0;
+    while (args.argv[argc] != NULL)
+        ++argc;
+
+    // The original output paths, which are staged in <dir>/o, <dir>/mf, <dir>/mod.
+    char const *output = NULL, *dep_file = NULL, *module_dir = NULL;
+    int has_md = 0, has_mt = 0;
+    for (size_t j = 1; j < argc; ++j) {
+        char const *arg = args.argv[j];
+        char const *value = j + 1 < argc ? args.argv[j + 1] : NULL;
+        if (arg[0] != '-')
+            continue;
+        // These record the output path in the output itself.
+        if (strcmp(arg, "-gsplit-dwarf") == 0 || strcmp(arg, "--coverage") == 0 ||
+            strcmp(arg, "-ftest-coverage") == 0 || strcmp(arg, "-fprofile-arcs") == 0 ||
+            strncmp(arg, "-fprofile-generate", 18) == 0)
+            return;
+        if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0)
+            has_md = 1;
+        else if (strncmp(arg, "-MT", 3) == 0 || strncmp(arg, "-MQ", 3) == 0)
+            has_mt = 1;
+        if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0)
+            output = value;
+        else if (strncmp(arg, "--output=", 9) == 0)
+            output = arg + 9;
+        else if (strncmp(arg, "-o", 2) == 0 && s->type != SPACK_LD)
+            output = arg + 2;
+        else if (strcmp(arg, "-MF") == 0)
+            dep_file = value;
+        else if (strncmp(arg, "-MF", 3) == 0)
+            dep_file = arg + 3;
+        else if (strcmp(arg, "-J") == 0 || strcmp(arg, "-module") == 0)
+            module_dir = value;
+        else if (strncmp(arg, "-J", 2) == 0)
+            module_dir = arg + 2;
+        if ((flag_takes_value(arg) || strcmp(arg, "--output") == 0) && value != NULL)
+            ++j;
+    }
+    if (output == NULL || strcmp(output, "-") == 0)
+        return;
+
+    // Only regular files can be moved into place, not e.g. -o /dev/null or a FIFO.
+    struct stat st;
+    if ((stat(output, &st) == 0 && !S_ISREG(st.st_mode)) ||
+        (dep_file != NULL && stat(dep_file, &st) == 0 && !S_ISREG(st.st_mode)))
+        return;
+
+    char dir[SPACK_PATH_MAX], o_dir[SPACK_PATH_MAX], mf_dir[SPACK_PATH_MAX],
+        mod_dir[SPACK_PATH_MAX], staged_output[SPACK_PATH_MAX],
+        staged_dep_file[SPACK_PATH_MAX], output_dir[SPACK_PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s/spack-stage-XXXXXX", root) >=
+            (int)sizeof(dir) - 16 ||
+        strlen(output) >= SPACK_PATH_MAX ||
+        (dep_file != NULL && strlen(dep_file) >= SPACK_PATH_MAX))
+        return;
+    mkdir(root, 0777);
+    if (mkdtemp(dir) == NULL)
+        return;
+    snprintf(o_dir, sizeof(o_dir), "%s/o", dir);
+    snprintf(mf_dir, sizeof(mf_dir), "%s/mf", dir);
+    snprintf(mod_dir, sizeof(mod_dir), "%s/mod", dir);
+    if (snprintf(staged_output, sizeof(staged_output), "%s/%s", o_dir,
+                 get_filename(output)) >= (int)sizeof(staged_output) ||
+        (dep_file != NULL &&
+         snprintf(staged_dep_file, sizeof(staged_dep_file), "%s/%s", mf_dir,
+                  get_filename(dep_file)) >= (int)sizeof(staged_dep_file)) ||
+        mkdir(o_dir, 0777) != 0 || (dep_file != NULL && mkdir(mf_dir, 0777) != 0) ||
+        (module_dir != NULL && mkdir(mod_dir, 0777) != 0)) {
+        publish_dir(o_dir, NULL, 0);
+        publish_dir(mf_dir, NULL, 0);
+        publish_dir(mod_dir, NULL, 0);
+        rmdir(dir);
+        return;
+    }
+    dir_name(output, output_dir);
+
+    // Same command, with staged paths; existing modules remain visible via -I, and
+    // dependency files keep the original target.
+    char **argv = malloc((argc + 10) * sizeof(char *));
+    size_t n = 0;
+    argv[n++] = args.argv[0];
+    for (size_t j = 1; j < argc; ++j) {
+        char *arg = args.argv[j];
+        char *value = j + 1 < argc ? args.argv[j + 1] : NULL;
+        int takes_value = arg[0] == '-' && value != NULL &&
+                          (flag_takes_value(arg) || strcmp(arg, "--output") == 0);
+        if (arg[0] != '-') {
+            argv[n++] = arg;
+            continue;
+        }
+        if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0 ||
+            strncmp(arg, "--output=", 9) == 0 ||
+            (strncmp(arg, "-o", 2) == 0 && s->type != SPACK_LD)) {
+            argv[n++] = "-o";
+            argv[n++] = staged_output;
+        } else if (strncmp(arg, "-MF", 3) == 0) {
+            argv[n++] = "-MF";
+            argv[n++] = staged_dep_file;
+        } else if (strncmp(arg, "-J", 2) == 0 || strcmp(arg, "-module") == 0) {
+            argv[n++] = arg[1] == 'J' ? "-J" : "-module";
+            argv[n++] = mod_dir;
+            argv[n++] = "-I";
+            argv[n++] = (char *)module_dir;
+        } else {
+            argv[n++] = arg;
+            if (takes_value)
+                argv[n++] = value;
+        }
+        if (takes_value)
+            ++j;
+    }
+    if (has_md && !has_mt) {
+        argv[n++] = "-MQ";
+        argv[n++] = (char *)output;
+    }
+    argv[n] = NULL;
+
+    int status = run_command(argv, args.env);
+    free(argv);
+
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int err = publish_dir(o_dir, ok ? output_dir : NULL, 0);
+    if (dep_file != NULL) {
+        if (ok && publish_file(staged_dep_file, dep_file) != 0) {
+            perror(dep_file);
+            err = 1;
+        }
+        publish_dir(mf_dir, NULL, 0);
+    }
+    if (module_dir != NULL)
+        err |= publish_dir(mod_dir, ok ? module_dir : NULL, 1);
+    rmdir(dir);
+
+    if (ok && err)
+        _exit(1);
+    exit_like(status);
+}
+
+// Configure probe cache
+
+struct probe_hash_t {
+    uint64_t a;
+    uint64_t b;
+};
+
+// Two independent 64-bit FNV-style hashes, for a 128-bit key.
+static void probe_hash_bytes(struct probe_hash_t *h, void const *buf, size_t n) {
+    unsigned char const *p = buf;
+    for (size_t j = 0; j < n; ++j) {
+        h->a = (h->a ^ p[j]) * 0x100000001b3ULL;
+        h->b = (((h->b << 5) | (h->b >> 59)) ^ p[j]) * 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+// Fields are length-prefixed, so they can't run into each other.
+static void probe_hash_field(struct probe_hash_t *h, void const *buf, size_t n) {
+    uint64_t len = n;
+    probe_hash_bytes(h, &len, sizeof(len));
+    probe_hash_bytes(h, buf, n);
+}
+
+// NULL hashes differently from "".
+static void probe_hash_string(struct probe_hash_t *h, char const *str) {
+    probe_hash_field(h, str == NULL ? "" : str, str == NULL ? 0 : strlen(str) + 1);
+}
+
+static int probe_hash_file(struct probe_hash_t *h, char const *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    uint64_t len = st.st_size;
+    probe_hash_bytes(h, &len, sizeof(len));
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        probe_hash_bytes(h, buf, n);
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+// Path, inode, size and mtime: identifies a compiler, and for a directory changes
+// when files are added or removed.
+static int probe_hash_stat(struct probe_hash_t *h, char const *path) {
+    struct stat st;
+    probe_hash_string(h, path);
+    if (stat(path, &st) != 0)
+        return -1;
+    uint64_t id[4] = {st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    probe_hash_field(h, id, sizeof(id));
+    return 0;
+}
+
+// Each directory of a colon separated list, so that installing a library there
+// changes the key.
+static void probe_hash_dirs(struct probe_hash_t *h, char const *dirs) {
+    char path[SPACK_PATH_MAX];
+    while (dirs != NULL && *dirs != '\0') {
+        char const *end = strchrnul(dirs, ':');
+        if (end - dirs < SPACK_PATH_MAX) {
+            memcpy(path, dirs, end - dirs);
+            path[end - dirs] = '\0';
+            probe_hash_stat(h, path);
+        }
+        dirs = *end == ':' ? end + 1 : end;
+    }
+}
+
+struct probe_t {
+    char const *source;
+    char const *output;
+};
+
+// A compile or link of a single source, without outputs besides -o.
+static int probe_scan(char *const *argv, size_t first, struct probe_t *p) {
+    memset(p, 0, sizeof(*p));
+    for (size_t j = first; argv[j] != NULL; ++j) {
+        char const *arg = argv[j];
+        if (arg[0] == '@' || strcmp(arg, "-") == 0 || local_only_flag(arg) ||
+            strncmp(arg, "-M", 2) == 0 || strncmp(arg, "-fprofile", 9) == 0 ||
+            strncmp(arg, "-J", 2) == 0 || strcmp(arg, "-module") == 0)
+            return 0;
+        if (arg[0] != '-') {
+            if (p->source != NULL || !source_file(arg))
+                return 0;
+            p->source = arg;
+            continue;
+        }
+        if (strcmp(arg, "-o") == 0)
+            p->output = argv[j + 1];
+        else if (strncmp(arg, "-o", 2) == 0)
+            p->output = arg + 2;
+        if (flag_takes_value(arg) && argv[++j] == NULL)
+            return 0;
+    }
+    return p->source != NULL && (p->output == NULL || strcmp(p->output, "-") != 0);
+}
+
+// Autoconf and libtool probes: conftest.c, conftest.o, conftest, conftest.exe, ...
+static int probe_file(char const *path) {
+    char const *name = get_filename(path);
+    return strncmp(name, "conftest", 8) == 0 && (name[8] == '\0' || name[8] == '.');
+}
+
+// Failures that come from the machine rather than the probe, like a full disk or
+// the compiler being killed, must not be replayed.
+static int probe_transient_failure(int fd) {
+    static const int errnos[] = {ENOSPC, EDQUOT, ENOMEM, EMFILE, ENFILE, EAGAIN,
+                                 EIO,    EROFS,  EACCES, EINTR,  ETIMEDOUT};
+    static const char *messages[] = {"internal compiler error", "terminated signal",
+                                     "terminated with signal", "Killed"};
+    char buf[65536];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0)
+        return 1;
+    buf[n] = '\0';
+    for (size_t j = 0; j < sizeof(errnos) / sizeof(int); ++j)
+        if (strstr(buf, strerror(errnos[j])) != NULL)
+            return 1;
+    for (size_t j = 0; j < sizeof(messages) / sizeof(char *); ++j)
+        if (strstr(buf, messages[j]) != NULL)
+            return 1;
+    return 0;
+}
+
+// Replay a cache entry; returns the exit status, or -1 when there is none.
+static int probe_replay(char const *entry, char const *output) {
+    char path[SPACK_PATH_MAX], buf[16];
+    snprintf(path, sizeof(path), "%s/status", entry);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    int code = atoi(buf);
+
+    snprintf(path, sizeof(path), "%s/output", entry);
+    if (code == 0 && copy_file(path, output) != 0)
+        return -1;
+    if (code != 0)
+        unlink(output);
+
+    static const char *streams[] = {"stdout", "stderr"};
+    for (int j = 0; j < 2; ++j) {
+        snprintf(path, sizeof(path), "%s/%s", entry, streams[j]);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            copy_fd(fd, j + 1);
+            close(fd);
+        }
+    }
+    return code;
+}
+
+// With SPACK_PROBE_CACHE_DIR=<dir>, memoize the conftest compiles and links of
+// configure scripts (sources of at most SPACK_PROBE_CACHE_MAX_SOURCE bytes), failed
+// ones included. The key is the rewritten command line, the compiler, the source
+// and its preprocessed form, and for links the library directories and the
+// environment of the nested ld rewrite; an entry holds the exit status, stdout,
+// stderr and output file. Does not return when the command ran or was replayed.
+static void maybe_probe_cache(struct state_t const *s, struct new_args args) {
+    char const *root = getenv("SPACK_PROBE_CACHE_DIR");
+    if (root == NULL || (s->mode != SPACK_MODE_CCLD && s->mode != SPACK_MODE_CC) ||
+        (s->type != SPACK_CC && s->type != SPACK_CXX && s->type != SPACK_FC &&
+         s->type != SPACK_F77) ||
+        strlen(root) + 64 >= SPACK_PATH_MAX)
+        return;
+
+    struct probe_t p;
+    struct stat st;
+    char const *max_source = getenv("SPACK_PROBE_CACHE_MAX_SOURCE");
+    if (!probe_scan(args.argv, s->has_ccache ? 2 : 1, &p) || !probe_file(p.source) ||
+        stat(p.source, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > (max_source ? atoll(max_source) : 65536))
+        return;
+
+    // The compiler's default output: a.out, or the source name with .o.
+    char default_output[SPACK_PATH_MAX];
+    if (p.output == NULL && s->mode == SPACK_MODE_CCLD) {
+        p.output = "a.out";
+    } else if (p.output == NULL) {
+        char const *name = get_filename(p.source);
+        char const *ext = strrchr(name, '.');
+        size_t len = ext != NULL ? (size_t)(ext - name) : strlen(name);
+        if (len + 3 > sizeof(default_output))
+            return;
+        memcpy(default_output, name, len);
+        strcpy(default_output + len, ".o");
+        p.output = default_output;
+    }
+    // Don't touch e.g. -o /dev/null.
+    if (!probe_file(p.output) || (stat(p.output, &st) == 0 && !S_ISREG(st.st_mode)))
+        return;
+
+    char tmp[SPACK_PATH_MAX], entry[SPACK_PATH_MAX], unit[SPACK_PATH_MAX],
+        cpp_err[SPACK_PATH_MAX], path[SPACK_PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/tmp-XXXXXX", root);
+    mkdir(root, 0777);
+    if (mkdtemp(tmp) == NULL)
+        return;
+    snprintf(unit, sizeof(unit), "%s/unit", tmp);
+    snprintf(cpp_err, sizeof(cpp_err), "%s/cpp-stderr", tmp);
+
+    struct probe_hash_t h = {0xcbf29ce484222325ULL, 0};
+    size_t argc = 0;
+    int debug = 0;
+    for (; args.argv[argc] != NULL; ++argc) {
+        char const *arg = args.argv[argc];
+        probe_hash_string(&h, arg);
+        if (strncmp(arg, "-g", 2) == 0 && strcmp(arg, "-g0") != 0)
+            debug = 1;
+    }
+    probe_hash_string(&h, NULL);
+    int err = probe_hash_stat(&h, args.argv[s->has_ccache ? 1 : 0]);
+    static const char *vars[] = {"CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH",
+                                 "LIBRARY_PATH", "COMPILER_PATH", "GCC_EXEC_PREFIX"};
+    for (size_t j = 0; j < sizeof(vars) / sizeof(char *); ++j)
+        probe_hash_string(&h, getenv(vars[j]));
+    probe_hash_dirs(&h, getenv("LIBRARY_PATH"));
+    for (size_t j = 1; j < argc; ++j) {
+        if (strcmp(args.argv[j], "-L") == 0 && j + 1 < argc)
+            probe_hash_stat(&h, args.argv[++j]);
+        else if (strncmp(args.argv[j], "-L", 2) == 0)
+            probe_hash_stat(&h, args.argv[j] + 2);
+    }
+
+    // The linker the compiler runs is rewritten again from these variables.
+    if (s->mode == SPACK_MODE_CCLD) {
+        static const char *ld_vars[] = {"SPACK_LD",
+                                        "SPACK_LD_DONE",
+                                        "SPACK_LINK_DIRS",
+                                        "SPACK_RPATH_DIRS",
+                                        "SPACK_COMPILER_EXTRA_RPATHS",
+                                        "SPACK_COMPILER_IMPLICIT_RPATHS",
+                                        "SPACK_LDLIBS",
+                                        "SPACK_LDFLAGS",
+                                        "SPACK_DTAGS_TO_ADD",
+                                        "SPACK_SYSTEM_DIRS",
+                                        "SPACK_TARGET_ARGS",
+                                        "SPACK_LTO",
+                                        "SPACK_LTO_CACHE_DIR",
+                                        "SPACK_LTO_CACHE_SIZE"};
+        for (size_t j = 0; j < sizeof(ld_vars) / sizeof(char *); ++j)
+            probe_hash_string(&h, getenv(ld_vars[j]));
+        char const *ld = getenv("SPACK_LD");
+        if (ld != NULL)
+            probe_hash_stat(&h, ld);
+        probe_hash_dirs(&h, getenv("SPACK_LINK_DIRS"));
+    }
+
+    // Debug info records the working directory and source lines.
+    if (debug) {
+        if (getcwd(path, sizeof(path)) == NULL)
+            err = 1;
+        probe_hash_string(&h, err ? NULL : path);
+    }
+
+    // Hash the source itself, and the preprocessed source for the headers; with
+    // debug info keep its line markers. When it doesn't preprocess, hash the error.
+    err |= probe_hash_file(&h, p.source);
+    char **pp = malloc((argc + 5) * sizeof(char *));
+    size_t n = 0;
+    for (size_t j = 0; j < argc; ++j) {
+        if (j > 0 && strcmp(args.argv[j], "-o") == 0) {
+            ++j;
+            continue;
+        }
+        if (j > 0 && strncmp(args.argv[j], "-o", 2) == 0)
+            continue;
+        pp[n++] = args.argv[j];
+    }
+    pp[n++] = "-E";
+    if (!debug)
+        pp[n++] = "-P";
+    pp[n++] = "-o";
+    pp[n++] = unit;
+    pp[n] = NULL;
+    int cpp_err_fd = open(cpp_err, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int status = cpp_err_fd < 0 ? W_EXITCODE(1, 0)
+                                : run_command_io(pp, args.env, -1, cpp_err_fd);
+    free(pp);
+    if (cpp_err_fd >= 0)
+        close(cpp_err_fd);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        err |= probe_hash_file(&h, unit);
+    else
+        err |= probe_hash_file(&h, cpp_err);
+    unlink(unit);
+    unlink(cpp_err);
+    if (err) {
+        publish_dir(tmp, NULL, 0);
+        return;
+    }
+
+    snprintf(entry, sizeof(entry), "%s/%016llx%016llx", root, (unsigned long long)h.a,
+             (unsigned long long)h.b);
+    int code = probe_replay(entry, p.output);
+    if (code >= 0) {
+        publish_dir(tmp, NULL, 0);
+        _exit(code);
+    }
+
+    // Miss: run the command with its output going to the new entry.
+    char out_path[SPACK_PATH_MAX], err_path[SPACK_PATH_MAX];
+    snprintf(out_path, sizeof(out_path), "%s/stdout", tmp);
+    snprintf(err_path, sizeof(err_path), "%s/stderr", tmp);
+    int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int err_fd = open(err_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0 || err_fd < 0) {
+        if (out >= 0)
+            close(out);
+        if (err_fd >= 0)
+            close(err_fd);
+        publish_dir(tmp, NULL, 0);
+        return;
+    }
+    status = run_command_io(args.argv, args.env, out, err_fd);
+    // Replays remove the output of failures, so do the same here.
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        unlink(p.output);
+    copy_fd(out, 1);
+    copy_fd(err_fd, 2);
+    int transient = probe_transient_failure(err_fd);
+    close(out);
+    close(err_fd);
+
+    // Don't cache commands that were killed, couldn't be run or failed for reasons
+    // outside of the probe. Another process may have added the same entry in the
+    // meantime; then the rename fails.
+    code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    int cached = 0;
+    if (code == 0 || (code > 0 && code < 126 && !transient)) {
+        snprintf(path, sizeof(path), "%s/output", tmp);
+        if (code != 0 || copy_file(p.output, path) == 0) {
+            char buf[16];
+            int len = snprintf(buf, sizeof(buf), "%d\n", code);
+            snprintf(path, sizeof(path), "%s/status", tmp);
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            cached = fd >= 0 && spack_write_all(fd, buf, len) == 0 && close(fd) == 0 &&
+                     rename(tmp, entry) == 0;
+        }
+    }
+    if (!cached)
+        publish_dir(tmp, NULL, 0);
+    exit_like(status);
+}
+
+// Metrics
+
+// Map SPACK_METRICS_FILE, creating it if necessary.
+static struct spack_metrics_t *metrics_map(void) {
+    char const *path = getenv("SPACK_METRICS_FILE");
+    if (path == NULL)
+        return NULL;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    struct spack_metrics_t *m = NULL;
+    if (fstat(fd, &st) == 0 &&
+        (st.st_size >= (off_t)sizeof(*m) || ftruncate(fd, sizeof(*m)) == 0))
+        m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == NULL || m == MAP_FAILED)
+        return NULL;
+
+    uint64_t magic = 0;
+    if (__atomic_compare_exchange_n(&m->magic, &magic, SPACK_METRICS_MAGIC, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+        magic == SPACK_METRICS_MAGIC)
+        return m;
+
+    // Some other layout; leave it alone.
+    munmap(m, sizeof(*m));
+    return NULL;
+}
+
+static void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t elapsed_ns(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec -
+           start->tv_nsec;
+}
+
+// Record one exec; `s` is NULL for calls that were passed through.
+static void maybe_record_metrics(enum executable_t type, struct state_t const *s,
+                                 struct timespec const *start) {
+    struct spack_metrics_t *m = metrics_map();
+    if (m == NULL)
+        return;
+
+    metrics_add(&m->execs, 1);
+    metrics_add(&m->executable[type], 1);
+    if (s == NULL) {
+        metrics_add(&m->passthrough, 1);
+    } else {
+        metrics_add(&m->rewritten, 1);
+        metrics_add(&m->mode[s->mode], 1);
+        metrics_add(&m->bytes_copied, s->strings.n);
+    }
+
+    uint64_t ns = elapsed_ns(start);
+    size_t bucket = 0;
+    while (bucket + 1 < SPACK_METRICS_BUCKETS && ns >> (bucket + 1) != 0)
+        ++bucket;
+    metrics_add(&m->total_ns, ns);
+    metrics_add(&m->latency[bucket], 1);
+    munmap(m, sizeof(*m));
+}
+
+// Whether a mode applies that runs the command under supervision of the wrapper.
+static int supervised(struct state_t const *s) {
+    int compile = s->mode == SPACK_MODE_CC || s->mode == SPACK_MODE_CCLD;
+    if (compile && (getenv("SPACK_SPLIT_JOBS") != NULL ||
+                    getenv("SPACK_PROBE_CACHE_DIR") != NULL ||
+                    getenv("SPACK_REMOTE_EXECUTOR") != NULL))
+        return 1;
+    return getenv("SPACK_OUTPUT_STAGING_DIR") != NULL &&
+           (compile || s->type == SPACK_LD || s->mode == SPACK_MODE_AS);
+}
+
 // The exec* + posix_spawn calls we wrap
 
 __attribute__((visibility("default"))) int execve(const char *path, char *const *argv,
                                                   char *const *envp) {
     struct state_t s;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     typeof(execve) *next = dlsym(RTLD_NEXT, "execve");
-    if (!should_intercept(path, argv, &s))
+    if (!should_intercept(path, argv, &s)) {
+        maybe_record_metrics(s.type, NULL, &start);
         return next(path, argv, envp);
+    }
+    s.context = SPACK_CONTEXT_EXEC;
     struct new_args args = rewrite_args_and_env(argv, envp, &s);
     maybe_debug(&s, path, argv, args.argv);
+    maybe_record_metrics(s.type, &s, &start);
+    maybe_split(&s, args);
+    maybe_probe_cache(&s, args);
+    maybe_offload(&s, args);
+    maybe_stage(&s, args);
     return next(args.argv[0], args.argv, args.env);
 }
 
 __attribute__((visibility("default"))) int execvpe(const char *file, char *const *argv,
                                                    char *const *envp) {
     struct state_t s;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     typeof(execvpe) *next = dlsym(RTLD_NEXT, "execvp");
-    if (!should_intercept(file, argv, &s))
+    if (!should_intercept(file, argv, &s)) {
+        maybe_record_metrics(s.type, NULL, &start);
         return next(file, argv, envp);
+    }
+    s.context = SPACK_CONTEXT_EXEC;
     struct new_args args = rewrite_args_and_env(argv, envp, &s);
     maybe_debug(&s, file, argv, args.argv);
+    maybe_record_metrics(s.type, &s, &start);
+    maybe_split(&s, args);
+    maybe_probe_cache(&s, args);
+    maybe_offload(&s, args);
+    maybe_stage(&s, args);
     return next(args.argv[0], args.argv, args.env);
 }
 
@@ -798,16 +2731,62 @@ posix_spawn(pid_t *pid, const char *path,
             const posix_spawn_file_actions_t *file_actions,
             const posix_spawnattr_t *attrp, char *const *argv, char *const *envp) {
     struct state_t s;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     typeof(posix_spawn) *next = dlsym(RTLD_NEXT, "posix_spawn");
-    if (!should_intercept(path, argv, &s))
+    if (!should_intercept(path, argv, &s)) {
+        maybe_record_metrics(s.type, NULL, &start);
         return next(pid, path, file_actions, attrp, argv, envp);
+    }
+    // Supervision needs a process of its own: spawn a shell that execs the
+    // command, which then goes through execve above.
+    if (supervised(&s) && argv[0] != NULL) {
+        size_t argc = 0;
+        while (argv[argc] != NULL)
+            ++argc;
+        char **sh = alloca((argc + 4) * sizeof(char *));
+        sh[0] = "/bin/sh";
+        sh[1] = "-c";
+        sh[2] = "exec \"$0\" \"$@\"";
+        sh[3] = (char *)path;
+        if (strchr(path, '/') == NULL) {
+            sh[3] = alloca(strlen(path) + 3);
+            strcpy(stpcpy(sh[3], "./"), path);
+        }
+        for (size_t j = 1; j <= argc; ++j)
+            sh[3 + j] = argv[j];
+        return next(pid, sh[0], file_actions, attrp, sh, envp);
+    }
+    s.context = SPACK_CONTEXT_SPAWN;
     struct new_args args = rewrite_args_and_env(argv, envp, &s);
     maybe_debug(&s, path, argv, args.argv);
+    maybe_record_metrics(s.type, &s, &start);
     return next(pid, args.argv[0], file_actions, attrp, args.argv, args.env);
 }
 
 // Fallback to execve / execvpe
 
+static int count_args(va_list *ap) {
+    va_list aq;
+    va_copy(aq, *ap);
+
+    int i = 0;
+    while (va_arg(aq, char *))
+        i++;
+    va_end(aq);
+    return i;
+}
+
+static void copy_args(char **argv, const char *arg0, va_list *ap) {
+    int i = 1;
+    char *arg;
+    while ((arg = va_arg(*ap, char *)))
+        argv[i++] = arg;
+
+    ((const char **)argv)[0] = arg0;
+    ((const char **)argv)[i] = NULL;
+}
+
 __attribute__((visibility("default"))) int execl(const char *path, const char *arg0,
                                                  ...) {
     va_list ap;
@@ -846,3 +2825,5 @@ __attribute__((visibility("default"))) int execv(const char *path, char *const *
 __attribute__((visibility("default"))) int execvp(const char *file, char *const *argv) {
     return execvpe(file, argv, environ);
 }
+
+#endif // SPACK_REWRITE_LIBRARY
@@ -0,0 +1,29 @@
+// In-process access to the argument rewriting of spack-compiler-wrapper.so, without
+// exec'ing anything; link to libspack-rewrite.so. The rewrite uses the SPACK_*
+// variables in the environment of the calling process, read once per executable
+// type and mode, and has no side effects: cache directories are not created and
+// profiles are not merged.
+
+#ifndef SPACK_COMPILER_WRAPPER_H
+#define SPACK_COMPILER_WRAPPER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct spack_rewriter_t;
+
+struct spack_rewriter_t *spack_rewriter_create(void);
+
+void spack_rewriter_destroy(struct spack_rewriter_t *r);
+
+// Rewrite argv the way the wrapper would when argv[0] is exec'd. Returns a
+// NULL-terminated argv that is valid until the next call, or NULL when the
+// command would not be intercepted.
+char *const *spack_rewrite_args(struct spack_rewriter_t *r, char *const *argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+// Wire format between spack-compiler-wrapper.so and spack-compiler-executor.
+//
+// Integers are big-endian, strings and blobs are a u64 length followed by the
+// bytes (no trailing \0).
+//
+// Request:  "SPCX" u32:version u32:argc string[argc]:argv string:cwd
+//           string:suffix blob:preprocessed-unit
+// Response: "SPCX" u32:status blob:stdout blob:stderr blob:object
+//
+// The executor compiles `argv -o <tmp>.o <tmp><suffix>` in cwd (if it exists
+// there) and replies with the exit status of the compiler, its output, and the
+// object file if the status is 0. The status is SPACK_EXECUTOR_ERROR when the
+// executor couldn't run the compiler or it was killed; the client then compiles
+// locally.
+
+#ifndef SPACK_EXECUTOR_PROTOCOL_H
+#define SPACK_EXECUTOR_PROTOCOL_H
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SPACK_EXECUTOR_MAGIC "SPCX"
+#define SPACK_EXECUTOR_VERSION 2
+#define SPACK_EXECUTOR_ERROR 0xffffffffu
+
+static inline int spack_write_all(int fd, void const *buf, size_t n) {
+    char const *p = buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// Like spack_write_all for sockets, but a closed connection is an error rather
+// than a SIGPIPE.
+static inline int spack_send_all(int fd, void const *buf, size_t n) {
+    char const *p = buf;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static inline int spack_read_all(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static inline int spack_send_u32(int fd, uint32_t x) {
+    x = htobe32(x);
+    return spack_send_all(fd, &x, sizeof(x));
+}
+
+static inline int spack_send_bytes(int fd, void const *buf, uint64_t n) {
+    uint64_t len = htobe64(n);
+    if (spack_send_all(fd, &len, sizeof(len)) != 0)
+        return -1;
+    return spack_send_all(fd, buf, n);
+}
+
+static inline int spack_recv_u32(int fd, uint32_t *x) {
+    if (spack_read_all(fd, x, sizeof(*x)) != 0)
+        return -1;
+    *x = be32toh(*x);
+    return 0;
+}
+
+// Receives a blob into a malloc'ed buffer with a trailing \0.
+static inline char *spack_recv_bytes(int fd, uint64_t *n) {
+    uint64_t len;
+    if (spack_read_all(fd, &len, sizeof(len)) != 0)
+        return NULL;
+    len = be64toh(len);
+    if (len > SIZE_MAX - 1)
+        return NULL;
+    char *buf = malloc(len + 1);
+    if (buf == NULL)
+        return NULL;
+    if (spack_read_all(fd, buf, len) != 0) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    *n = len;
+    return buf;
+}
+
+#endif
@@ -0,0 +1,42 @@
+// Layout of the SPACK_METRICS_FILE, shared by spack-compiler-wrapper.so and
+// spack-compiler-stats.
+//
+// Every process maps the file and bumps the counters with atomic adds, so no
+// locking is needed. The file starts out zeroed; the first process stores the
+// magic. Latencies are the time spent in the wrapper itself per exec, in
+// log2-scale buckets: bucket i counts [2^i, 2^(i+1)) nanoseconds.
+
+#ifndef SPACK_METRICS_H
+#define SPACK_METRICS_H
+
+#include <stdint.h>
+
+#define SPACK_METRICS_MAGIC 0x325254454d4b5053ULL // "SPKMETR2"
+
+// Number of enum executable_t and enum mode_t values.
+#define SPACK_METRICS_EXECUTABLES 9
+#define SPACK_METRICS_MODES 6
+
+#define SPACK_METRICS_BUCKETS 40
+
+struct spack_metrics_t {
+    uint64_t magic;
+
+    // Calls to the exec* and posix_spawn wrappers.
+    uint64_t execs;
+    uint64_t rewritten;
+    uint64_t passthrough;
+
+    // All calls per enum executable_t, rewritten calls per enum mode_t.
+    uint64_t executable[SPACK_METRICS_EXECUTABLES];
+    uint64_t mode[SPACK_METRICS_MODES];
+
+    // Size of the rewritten arguments and environment.
+    uint64_t bytes_copied;
+
+    // Time spent in the wrapper.
+    uint64_t total_ns;
+    uint64_t latency[SPACK_METRICS_BUCKETS];
+};
+
+#endif
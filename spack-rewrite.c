@@ -0,0 +1,356 @@
+// Batch front-end to the argument rewriting of spack-compiler-wrapper.so.
+//
+// Usage: spack-rewrite
+//        spack-rewrite --compile-commands <compile_commands.json>
+//
+// Without arguments, reads one shell command line per line from stdin and writes
+// the rewritten command line to stdout; commands that are not intercepted are
+// written unchanged. With --compile-commands, writes the compilation database
+// with every "command" and "arguments" entry replaced by the rewritten
+// "arguments".
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "spack-compiler-wrapper.h"
+
+struct words_t {
+    char **arr;
+    size_t n;
+    size_t capacity;
+};
+
+static void words_push(struct words_t *w, char *word) {
+    if (w->n + 1 >= w->capacity) {
+        w->capacity = 2 * (w->n + 1);
+        char **arr = realloc(w->arr, w->capacity * sizeof(char *));
+        if (arr == NULL)
+            exit(1);
+        w->arr = arr;
+    }
+    w->arr[w->n++] = word;
+    w->arr[w->n] = NULL;
+}
+
+// Empty, but NULL-terminated.
+static void words_clear(struct words_t *w) {
+    w->n = 0;
+    words_push(w, NULL);
+    w->n = 0;
+}
+
+// Split a command line in place on unquoted whitespace, handling '', "" and \.
+static void split_command(char *line, struct words_t *w) {
+    words_clear(w);
+    char *in = line;
+    char *out = line;
+    while (1) {
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+            ++in;
+        if (*in == '\0')
+            return;
+        char *word = out;
+        char quote = '\0';
+        for (; *in != '\0'; ++in) {
+            if (quote == '\'') {
+                if (*in == '\'')
+                    quote = '\0';
+                else
+                    *out++ = *in;
+            } else if (*in == '\\' && in[1] != '\0' &&
+                       (quote == '\0' || strchr("\"\\$`", in[1]) != NULL)) {
+                *out++ = *++in;
+            } else if (quote == '"') {
+                if (*in == '"')
+                    quote = '\0';
+                else
+                    *out++ = *in;
+            } else if (*in == '\'' || *in == '"') {
+                quote = *in;
+            } else if (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') {
+                break;
+            } else {
+                *out++ = *in;
+            }
+        }
+        // The terminator may overwrite the separator we stopped at.
+        int end = *in == '\0';
+        *out++ = '\0';
+        words_push(w, word);
+        if (end)
+            return;
+        ++in;
+    }
+}
+
+// Characters that don't need quoting in a shell word.
+static int shell_safe(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || (c != '\0' && strchr("_@%+=:,./-", c) != NULL);
+}
+
+static void put_shell_word(char const *word, FILE *out) {
+    char const *c = word;
+    while (shell_safe(*c))
+        ++c;
+    if (*c == '\0' && c != word) {
+        fwrite_unlocked(word, 1, c - word, out);
+        return;
+    }
+    fputc_unlocked('\'', out);
+    for (c = word; *c != '\0'; ++c) {
+        if (*c == '\'')
+            fputs_unlocked("'\\''", out);
+        else
+            fputc_unlocked(*c, out);
+    }
+    fputc_unlocked('\'', out);
+}
+
+static int rewrite_lines(struct spack_rewriter_t *r) {
+    struct words_t w = {NULL, 0, 0};
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while ((len = getline(&line, &capacity, stdin)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        split_command(line, &w);
+        char *const *argv = w.n > 0 ? spack_rewrite_args(r, w.arr) : NULL;
+        if (argv == NULL)
+            argv = w.arr;
+        for (char *const *arg = argv; *arg != NULL; ++arg) {
+            if (arg != argv)
+                fputc_unlocked(' ', stdout);
+            put_shell_word(*arg, stdout);
+        }
+        fputc_unlocked('\n', stdout);
+    }
+    free(line);
+    free(w.arr);
+    return 0;
+}
+
+// compile_commands.json
+
+struct json_t {
+    char *p;
+    char const *path;
+};
+
+static void json_error(struct json_t *j, char const *what) {
+    fprintf(stderr, "%s: %s\n", j->path, what);
+    exit(1);
+}
+
+static void json_space(struct json_t *j) {
+    while (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r')
+        ++j->p;
+}
+
+static void json_expect(struct json_t *j, char c) {
+    json_space(j);
+    if (*j->p != c)
+        json_error(j, "unexpected character");
+    ++j->p;
+}
+
+static void put_utf8(char **out, unsigned long c) {
+    unsigned char *o = (unsigned char *)*out;
+    if (c < 0x80) {
+        *o++ = c;
+    } else if (c < 0x800) {
+        *o++ = 0xc0 | (c >> 6);
+        *o++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *o++ = 0xe0 | (c >> 12);
+        *o++ = 0x80 | ((c >> 6) & 0x3f);
+        *o++ = 0x80 | (c & 0x3f);
+    } else {
+        *o++ = 0xf0 | (c >> 18);
+        *o++ = 0x80 | ((c >> 12) & 0x3f);
+        *o++ = 0x80 | ((c >> 6) & 0x3f);
+        *o++ = 0x80 | (c & 0x3f);
+    }
+    *out = (char *)o;
+}
+
+// Decode a string in place; escapes never expand, so this is safe.
+static char *json_string(struct json_t *j) {
+    json_expect(j, '"');
+    char *str = j->p;
+    char *out = j->p;
+    while (*j->p != '"') {
+        if (*j->p == '\0')
+            json_error(j, "unterminated string");
+        if (*j->p != '\\') {
+            *out++ = *j->p++;
+            continue;
+        }
+        ++j->p;
+        switch (*j->p++) {
+        case '"':
+            *out++ = '"';
+            break;
+        case '\\':
+            *out++ = '\\';
+            break;
+        case '/':
+            *out++ = '/';
+            break;
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u': {
+            char hex[5] = {0};
+            if (strlen(j->p) < 4)
+                json_error(j, "invalid escape");
+            memcpy(hex, j->p, 4);
+            j->p += 4;
+            unsigned long c = strtoul(hex, NULL, 16);
+            if (c >= 0xd800 && c < 0xdc00 && j->p[0] == '\\' && j->p[1] == 'u') {
+                memcpy(hex, j->p + 2, 4);
+                unsigned long lo = strtoul(hex, NULL, 16);
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                    j->p += 6;
+                }
+            }
+            put_utf8(&out, c);
+            break;
+        }
+        default:
+            json_error(j, "invalid escape");
+        }
+    }
+    ++j->p;
+    *out = '\0';
+    return str;
+}
+
+static void put_json_string(char const *str, FILE *out) {
+    fputc_unlocked('"', out);
+    for (unsigned char const *c = (unsigned char const *)str; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc_unlocked(*c, out);
+    }
+    fputc_unlocked('"', out);
+}
+
+static void put_json_arguments(char *const *argv, FILE *out) {
+    fputs("\"arguments\": [", out);
+    for (char *const *arg = argv; *arg != NULL; ++arg) {
+        if (arg != argv)
+            fputs(", ", out);
+        put_json_string(*arg, out);
+    }
+    fputc_unlocked(']', out);
+}
+
+static int rewrite_compile_commands(struct spack_rewriter_t *r, char const *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *contents = open_memstream(&buf, &size);
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        fwrite(chunk, 1, n, contents);
+    fclose(f);
+    fclose(contents);
+
+    struct json_t j = {buf, path};
+    struct words_t w = {NULL, 0, 0};
+    json_expect(&j, '[');
+    fputs("[", stdout);
+    json_space(&j);
+    for (int first = 1; *j.p != ']'; first = 0) {
+        if (!first)
+            json_expect(&j, ',');
+        fputs(first ? "\n  {" : ",\n  {", stdout);
+        json_expect(&j, '{');
+        json_space(&j);
+        for (int first_key = 1; *j.p != '}'; first_key = 0) {
+            if (!first_key)
+                json_expect(&j, ',');
+            fputs(first_key ? "\n    " : ",\n    ", stdout);
+            char *key = json_string(&j);
+            json_expect(&j, ':');
+            json_space(&j);
+            if (strcmp(key, "command") == 0 || strcmp(key, "arguments") == 0) {
+                words_clear(&w);
+                if (strcmp(key, "command") == 0) {
+                    split_command(json_string(&j), &w);
+                } else {
+                    json_expect(&j, '[');
+                    json_space(&j);
+                    for (int first_arg = 1; *j.p != ']'; first_arg = 0) {
+                        if (!first_arg)
+                            json_expect(&j, ',');
+                        words_push(&w, json_string(&j));
+                        json_space(&j);
+                    }
+                    ++j.p;
+                }
+                char *const *argv = w.n > 0 ? spack_rewrite_args(r, w.arr) : NULL;
+                put_json_arguments(argv == NULL ? w.arr : argv, stdout);
+            } else {
+                put_json_string(key, stdout);
+                fputs(": ", stdout);
+                put_json_string(json_string(&j), stdout);
+            }
+            json_space(&j);
+        }
+        ++j.p;
+        fputs("\n  }", stdout);
+        json_space(&j);
+    }
+    fputs("\n]\n", stdout);
+
+    free(w.arr);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct spack_rewriter_t *r = spack_rewriter_create();
+    if (r == NULL)
+        return 1;
+
+    int ret;
+    if (argc == 1) {
+        ret = rewrite_lines(r);
+    } else if (argc == 3 && strcmp(argv[1], "--compile-commands") == 0) {
+        ret = rewrite_compile_commands(r, argv[2]);
+    } else {
+        fprintf(stderr, "usage: %s [--compile-commands <file>]\n", argv[0]);
+        ret = 1;
+    }
+
+    spack_rewriter_destroy(r);
+    return ret;
+}